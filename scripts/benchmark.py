@@ -0,0 +1,383 @@
+#! /usr/bin/env python3
+
+# This file is part of hbootdbg.
+# Copyright (c) 2013, Cedric Halbronn <cedric.halbronn@sogeti.com>
+# Copyright (c) 2013, Nicolas Hureau <nicolas.hureau@sogeti.com>
+# All right reserved.
+#
+# Redistribution and use in source and binary forms, with or without modification,
+# are permitted provided that the following conditions are met:
+# 
+# * Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+# 
+# * Redistributions in binary form must reproduce the above copyright notice, this
+#   list of conditions and the following disclaimer in the documentation and/or
+#   other materials provided with the distribution.
+# 
+# * Neither the name of the {organization} nor the names of its
+#   contributors may be used to endorse or promote products derived from
+#   this software without specific prior written permission.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+import argparse
+import binascii
+import random
+import re
+import sys
+import time
+import gdbproxy
+import hbootdbg
+import hbootsim
+import mirror
+
+HBOOT_BASE = 0x8D000000
+DEADC0DE = b'\xde\xc0\xad\xde'
+
+def synthetic_hboot(size, seed=0):
+    ''' Build an image looking like the HBOOT region: code, zeroed memory and
+    linker fill, in 4 KB pages '''
+    rand = random.Random(seed)
+    image = bytearray()
+    while len(image) < size:
+        kind = rand.random()
+        if kind < 0.45:
+            image += bytes(rand.getrandbits(8) for _ in range(4096))
+        elif kind < 0.75:
+            image += bytes(4096)
+        else:
+            image += DEADC0DE * 1024
+    return bytes(image[:size])
+
+##
+# Memory dump
+##
+
+def bench_dump(args):
+    if args.image:
+        image = open(args.image, 'rb').read()
+    else:
+        image = synthetic_hboot(args.size)
+
+    print('{:<12}{:>12}{:>12}{:>12}{:>12}{:>12}'.format(
+        'mode', 'link bytes', 'transfers', 'link (s)', 'host (s)', 'KB/s'))
+
+    for compressed in (False, True):
+        device = hbootsim.SimulatedDevice(args.bandwidth, args.latency)
+        device.map(HBOOT_BASE, image)
+        dbg = hbootdbg.HbootDbg(device)
+
+        dump = bytearray()
+        for offset in range(0, len(image), args.chunk):
+            size = min(args.chunk, len(image) - offset)
+            dump += dbg.read(HBOOT_BASE + offset, size, compressed).data
+
+        # The simulated device compresses in Python, which says nothing about
+        # what it costs on the phone: only decoding is timed on the host side
+        host_time = 0
+        if compressed:
+            blocks = [hbootsim.rle_compress(image[i:i + hbootsim.RLE_BLOCK_SIZE])
+                      for i in range(0, len(image), hbootsim.RLE_BLOCK_SIZE)]
+            start = time.perf_counter()
+            for block in blocks:
+                hbootdbg.rle_decompress(block)
+            host_time = time.perf_counter() - start
+        assert dump == image, 'corrupted dump'
+
+        total = device.link_time + host_time
+        print('{:<12}{:>12}{:>12}{:>12.3f}{:>12.3f}{:>12.0f}'.format(
+            'compressed' if compressed else 'raw',
+            device.link_bytes,
+            device.transfers,
+            device.link_time,
+            host_time,
+            len(image) / total / 1024))
+
+##
+# Memory mirror
+##
+
+STACK_BASE = 0x8D0C0000
+
+def bench_mirror(args):
+    ''' Re-read a large region and a stack on every stop, with plain reads and
+    with a TargetMemoryMirror, while the target changes a few words between
+    two stops '''
+    rand = random.Random(0)
+    image = synthetic_hboot(args.size)
+    stack = bytes(args.stack)
+
+    # Like compression in the dump benchmark, the CRCs computed by the device
+    # are not accounted: about 6 cycles per byte with the table
+    print('{:<12}{:>12}{:>12}{:>12}{:>12}'.format(
+        'mode', 'link bytes', 'transfers', 'link (s)', 'ms/stop'))
+
+    for mirrored in (False, True):
+        rand.seed(0)
+        device = hbootsim.SimulatedDevice(args.bandwidth, args.latency)
+        device.map(HBOOT_BASE, image)
+        device.map(STACK_BASE, stack)
+        dbg = hbootdbg.HbootDbg(device)
+        regions = ((HBOOT_BASE, len(image)), (STACK_BASE, len(stack)))
+
+        if mirrored:
+            local = mirror.TargetMemoryMirror(dbg, args.block)
+            for address, size in regions:
+                local.add_region(address, size)
+
+        for stop in range(args.stops):
+            # Between two stops, the target updates a few words at the top of
+            # the stack and a few globals
+            top = rand.randrange(0, len(stack), 4)
+            changes = [STACK_BASE + rand.randrange(top, len(stack), 4)
+                       for _ in range(8)]
+            changes += [HBOOT_BASE + rand.randrange(0, len(image), 4)
+                        for _ in range(2)]
+            for address in changes:
+                device.memory(address, 4)[:] = \
+                    rand.getrandbits(32).to_bytes(4, 'little')
+
+            if mirrored:
+                local.sync()
+            for address, size in regions:
+                if mirrored:
+                    data = local.read(address, size)
+                else:
+                    data = dbg.read(address, size).data
+                assert data == device.memory(address, size), 'corrupted copy'
+
+        if mirrored:
+            local.close()
+
+        print('{:<12}{:>12}{:>12}{:>12.3f}{:>12.2f}'.format(
+            'mirror' if mirrored else 'read',
+            device.link_bytes,
+            device.transfers,
+            device.link_time,
+            device.link_time / args.stops * 1000))
+
+##
+# GDB remote protocol parsing
+##
+
+def rsp_stream(count, size, seed=0):
+    ''' Acknowledged packets as sent by GDB: small reads, and hex and binary
+    writes of size bytes '''
+    rand = random.Random(seed)
+    server = gdbproxy.GDBServer.__new__(gdbproxy.GDBServer)
+    packets = []
+    for i in range(count):
+        kind = rand.random()
+        address = HBOOT_BASE + rand.randrange(0, 0x100000, 4)
+        if kind < 0.4:
+            packet = 'm{:x},4'.format(address).encode()
+        else:
+            data = bytes(rand.getrandbits(8) for _ in range(size))
+            if kind < 0.7:
+                packet = 'M{:x},{:x}:'.format(address, size).encode() + \
+                    binascii.hexlify(data)
+            else:
+                packet = 'X{:x},{:x}:'.format(address, size).encode() + data
+        packets.append(b'+' + server.pack([packet]))
+    return b''.join(packets)
+
+def bytewise_packets(stream):
+    ''' How packets used to be read: one recv() per byte, growing the packet
+    one byte at a time and unescaping it byte by byte '''
+    pos = 0
+    def recv(size):
+        nonlocal pos
+        pos += size
+        return stream[pos - size:pos]
+
+    count = 0
+    while True:
+        packet_type = recv(1)
+        if len(packet_type) == 0:
+            return count
+        if packet_type != b'$':
+            continue
+        data = b''
+        while True:
+            byte = recv(1)
+            if byte != b'#':
+                data += byte
+            else:
+                break
+        checksum = recv(2)
+        assert sum(c for c in data) % 256 == int(checksum, 16)
+        word = []
+        escaped = False
+        for c in data:
+            if escaped:
+                word.append(c ^ 0x20)
+                escaped = False
+            elif c == ord(b'}'):
+                escaped = True
+            else:
+                word.append(c)
+        count += 1
+
+def bench_rsp(args):
+    stream = rsp_stream(args.packets, args.size)
+
+    print('{:<12}{:>12}{:>12}{:>12}'.format(
+        'reader', 'packets', 'packets/s', 'MB/s'))
+
+    for name in ('bytewise', 'buffered'):
+        start = time.perf_counter()
+        if name == 'bytewise':
+            count = bytewise_packets(stream)
+        else:
+            reader = gdbproxy.PacketReader()
+            count = 0
+            for offset in range(0, len(stream), gdbproxy.RECV_SIZE):
+                for kind, data in reader.feed(
+                        stream[offset:offset + gdbproxy.RECV_SIZE]):
+                    if kind == b'$':
+                        assert data is not None, 'corrupted packet'
+                        count += 1
+        elapsed = time.perf_counter() - start
+        assert count == args.packets
+
+        print('{:<12}{:>12}{:>12.0f}{:>12.2f}'.format(
+            name, count, count / elapsed, len(stream) / elapsed / 1e6))
+
+##
+# GDB packet dispatch
+##
+
+class LinearDispatcher(gdbproxy.PatternDispatcher):
+    ''' How packets used to be dispatched: every regular expression tried in
+    turn, latest registered first '''
+
+    def __init__(self):
+        super().__init__()
+        self.handlers = []
+
+    def register(self, regexp, handler):
+        self.handlers.append((re.compile(regexp), handler))
+
+    def dispatch(self, command, *data_list):
+        for cmd_regexp, handler in reversed(self.handlers):
+            match = cmd_regexp.match(command)
+            if match:
+                return handler(self.owner, match, *data_list)
+        return None
+
+def synthetic_session(stops, seed=0):
+    ''' Packets as sent by GDB connecting, then stepping and inspecting
+    memory a number of times '''
+    rand = random.Random(seed)
+    server = gdbproxy.GDBServer.__new__(gdbproxy.GDBServer)
+    packets = [b'qSupported:multiprocess+;swbreak+;hwbreak+;qRelocInsn+',
+               b'Hg0', b'qAttached', b'qC', b'?', b'g']
+    for _ in range(stops):
+        pc = HBOOT_BASE + rand.randrange(0, 0x100000, 4)
+        packets += [b'g', b'p19', 'm{:x},4'.format(pc).encode()]
+        packets += ['m{:x},4'.format(0x8D0C0000 + rand.randrange(0, 0x4000, 4))
+                    .encode() for _ in range(12)]
+        packets += ['Z0,{:x},4'.format(pc + 8).encode(), b'c',
+                    'z0,{:x},4'.format(pc + 8).encode(), b's']
+    return b''.join(b'+' + server.pack([p]) for p in packets)
+
+def bench_dispatch(args):
+    if args.session:
+        stream = open(args.session, 'rb').read()
+    else:
+        stream = synthetic_session(args.stops)
+
+    server = gdbproxy.GDBServer.__new__(gdbproxy.GDBServer)
+    packets = [server.unpack(data)
+               for kind, data in gdbproxy.PacketReader().feed(stream)
+               if kind == b'$' and data is not None]
+
+    # Handlers do nothing, so that only the lookup is timed
+    handled = lambda owner, match, *data_list: True
+    patterns = [r.pattern for entries in gdbproxy.GDBServer.DISPATCHER
+                .handlers.values() for r, _ in entries]
+
+    print('{:<12}{:>12}{:>12}{:>12}'.format(
+        'dispatcher', 'handlers', 'packets', 'packets/s'))
+
+    for extra in (0, 50, 200):
+        # Stand-ins for the qXfer, vCont, ... handlers yet to come
+        dummies = ['^q{}Dummy{}$'.format(k, i).encode() for k in 'xyz'
+                   for i in range(extra // 3)]
+        for name, cls in (('linear', LinearDispatcher),
+                          ('table', gdbproxy.PatternDispatcher)):
+            dispatcher = cls()
+            for pattern in patterns + dummies:
+                dispatcher.register(pattern, handled)
+
+            start = time.perf_counter()
+            for _ in range(args.rounds):
+                for packet in packets:
+                    dispatcher.dispatch(packet[0], *packet[1:])
+            elapsed = time.perf_counter() - start
+
+            print('{:<12}{:>12}{:>12}{:>12.0f}'.format(
+                name, len(patterns) + len(dummies), len(packets),
+                len(packets) * args.rounds / elapsed))
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    subparsers = parser.add_subparsers(dest='bench')
+    subparsers.required = True
+
+    dump = subparsers.add_parser('dump',
+            help='raw vs compressed memory dumps against a simulated device')
+    dump.add_argument('-s', '--size', type=lambda x: int(x, 0),
+            default=0x100000)
+    dump.add_argument('-i', '--image', type=str,
+            help='dump this file instead of a synthetic HBOOT image')
+    dump.add_argument('-c', '--chunk', type=lambda x: int(x, 0),
+            default=0x10000)
+    dump.add_argument('-b', '--bandwidth', type=int, default=1000000,
+            help='simulated link bandwidth, in bytes/s')
+    dump.add_argument('-l', '--latency', type=float, default=0.000125,
+            help='simulated latency of a single USB transfer, in s')
+    dump.set_defaults(func=bench_dump)
+
+    mirror_ = subparsers.add_parser('mirror',
+            help='plain reads vs TargetMemoryMirror across repeated stops')
+    mirror_.add_argument('-s', '--size', type=lambda x: int(x, 0),
+            default=0x100000)
+    mirror_.add_argument('-k', '--stack', type=lambda x: int(x, 0),
+            default=0x4000)
+    mirror_.add_argument('-n', '--stops', type=int, default=20)
+    mirror_.add_argument('-B', '--block', type=lambda x: int(x, 0),
+            default=mirror.MIRROR_BLOCK_SIZE)
+    mirror_.add_argument('-b', '--bandwidth', type=int, default=1000000)
+    mirror_.add_argument('-l', '--latency', type=float, default=0.000125)
+    mirror_.set_defaults(func=bench_mirror)
+
+    rsp = subparsers.add_parser('rsp',
+            help='GDB remote protocol packets parsed per second')
+    rsp.add_argument('-n', '--packets', type=int, default=5000)
+    rsp.add_argument('-s', '--size', type=lambda x: int(x, 0),
+            default=0x200,
+            help='size of the data written by M and X packets')
+    rsp.set_defaults(func=bench_rsp)
+
+    dispatch = subparsers.add_parser('dispatch',
+            help='GDB packets dispatched per second')
+    dispatch.add_argument('-i', '--session', type=str,
+            help='replay a session saved by gdbproxy.py --record instead of '
+                 'a synthetic one')
+    dispatch.add_argument('-n', '--stops', type=int, default=200)
+    dispatch.add_argument('-r', '--rounds', type=int, default=20)
+    dispatch.set_defaults(func=bench_dispatch)
+
+    args = parser.parse_args()
+    args.func(args)
@@ -0,0 +1,281 @@
+#! /usr/bin/env python3
+
+# This file is part of hbootdbg.
+# Copyright (c) 2013, Cedric Halbronn <cedric.halbronn@sogeti.com>
+# Copyright (c) 2013, Nicolas Hureau <nicolas.hureau@sogeti.com>
+# All right reserved.
+#
+# Redistribution and use in source and binary forms, with or without modification,
+# are permitted provided that the following conditions are met:
+# 
+# * Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+# 
+# * Redistributions in binary form must reproduce the above copyright notice, this
+#   list of conditions and the following disclaimer in the documentation and/or
+#   other materials provided with the distribution.
+# 
+# * Neither the name of the {organization} nor the names of its
+#   contributors may be used to endorse or promote products derived from
+#   this software without specific prior written permission.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+''' Block coverage of a code range, with one-shot breakpoints on the first
+instruction of every basic block. The debugger records and removes them as
+they are hit without involving the host, the bitmap of the blocks reached is
+read back at the end and exported in the drcov or lcov format.
+
+Blocks are found with darm, built as a shared library from the debugger
+sources:
+
+    cc -shared -fPIC -fcommon -o libdarm.so src/hbootdbg/darm/*.c
+'''
+
+import argparse
+import ctypes
+import os
+import re
+import struct
+import time
+import hbootdbg
+
+DARM_TABLES = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                           os.pardir, 'src', 'hbootdbg', 'darm', 'darm-tbl.h')
+
+# Longest block recorded in drcov files
+DRCOV_MAX_BLOCK_SIZE            = 0xffff
+
+def darm_enum(name, path=DARM_TABLES):
+    ''' Values of a darm enumeration, none of which is explicit '''
+    with open(path) as f:
+        text = f.read()
+    body = re.search(r'typedef enum _{0} {{(.*?)}} {0};'.format(name),
+                     text, re.S).group(1)
+    body = re.sub(r'//[^\n]*', '', body)
+    names = [n.strip() for n in body.split(',') if n.strip()]
+    return {n: i for i, n in enumerate(names)}
+
+class Darm(ctypes.Structure):
+    ''' darm_t, see src/hbootdbg/darm/darm.h '''
+    _fields_ = (
+        [('w', ctypes.c_uint32)] +
+        [(n, ctypes.c_int) for n in ('instr', 'instr_type', 'instr_imm_type',
+                                     'instr_flag_type', 'cond')] +
+        [(n, ctypes.c_uint32) for n in ('B', 'S', 'E', 'M', 'N')] +
+        [('option', ctypes.c_int)] +
+        [(n, ctypes.c_uint32) for n in ('U', 'H', 'P', 'R', 'T', 'W', 'I',
+                                        'rotate')] +
+        [(n, ctypes.c_int) for n in ('Rd', 'Rn', 'Rm', 'Ra', 'Rt', 'Rt2',
+                                     'RdHi', 'RdLo')] +
+        [('imm', ctypes.c_uint32), ('sat_imm', ctypes.c_uint32),
+         ('shift_type', ctypes.c_int), ('Rs', ctypes.c_int)] +
+        [(n, ctypes.c_uint32) for n in ('shift', 'lsb', 'msb', 'width')] +
+        [('reglist', ctypes.c_uint16)] +
+        [(n, ctypes.c_uint8) for n in ('coproc', 'opc1', 'opc2')] +
+        [(n, ctypes.c_int) for n in ('CRd', 'CRn', 'CRm')] +
+        [('D', ctypes.c_uint32), ('firstcond', ctypes.c_int),
+         ('mask', ctypes.c_uint8)]
+    )
+
+class Disassembler:
+    ''' Control flow of ARM instructions, decoded by darm '''
+
+    # Flow of an instruction
+    NONE = 0
+    BRANCH = 1          # Unconditional, execution does not go on after it
+    CONDITIONAL = 2     # Conditional, or a call which returns after it
+
+    def __init__(self, library='libdarm.so'):
+        self._lib = ctypes.CDLL(library)
+        self._lib.darm_armv7_disasm.argtypes = (ctypes.POINTER(Darm),
+                                                ctypes.c_uint32)
+        self._d = Darm()
+        self._i = darm_enum('darm_instr_t')
+        self._t = darm_enum('darm_enctype_t')
+        self._writes_rd = {self._t[t] for t in (
+            'T_ARM_ARITH_SHIFT', 'T_ARM_ARITH_IMM', 'T_ARM_DST_SRC',
+            'T_ARM_MOV_IMM')}
+
+    def flow(self, word, pc):
+        ''' (flow, target) of the instruction word at pc, target being the
+        address of ARM code it branches to if known '''
+        d = self._d
+        if self._lib.darm_armv7_disasm(ctypes.byref(d), word) != 0:
+            return self.NONE, None
+
+        i, t = self._i, self._t
+        conditional = (word >> 28) < 0xe
+        call = False
+        target = None
+
+        if d.instr_type == t['T_ARM_BRNCHSC'] and d.instr in (i['I_B'],
+                                                              i['I_BL']):
+            target = (pc + 8 + d.imm) & 0xffffffff
+            call = d.instr == i['I_BL']
+        elif d.instr_type == t['T_ARM_UNCOND'] and d.instr == i['I_BLX']:
+            # Thumb code is not covered
+            call = True
+        elif d.instr_type == t['T_ARM_BRNCHMISC'] and d.instr in (i['I_BX'],
+                                                                  i['I_BLX']):
+            call = d.instr == i['I_BLX']
+        elif d.instr_type in self._writes_rd:
+            if (word >> 12) & 0xf != 15 or d.instr in (i['I_MOVW'],
+                                                       i['I_MOVT']):
+                return self.NONE, None
+        elif d.instr_type == t['T_ARM_STACK0']:
+            # LDR pc
+            if not (word & (1 << 20)) or word & (1 << 22) or \
+                    (word >> 12) & 0xf != 15:
+                return self.NONE, None
+        elif d.instr_type == t['T_ARM_LDSTREGS']:
+            # LDM with pc in the list
+            if not (word & (1 << 20)) or not (word & (1 << 15)):
+                return self.NONE, None
+        else:
+            return self.NONE, None
+
+        return (self.CONDITIONAL if conditional or call else self.BRANCH,
+                target)
+
+def literal_address(word, pc):
+    ''' Address loaded by a LDR literal instruction, None for others '''
+    if word & 0x0f3f0000 != 0x051f0000:
+        return None
+    offset = word & 0xfff
+    return pc + 8 + (offset if word & (1 << 23) else -offset)
+
+def find_blocks(disasm, code, address):
+    ''' Basic blocks of the ARM code at address, as (address, size) tuples.
+    Blocks start at the beginning of the range, at branch targets and after
+    conditional branches and calls. Code following an unconditional branch is
+    only a block if something branches to it, which keeps literal pools out,
+    as well as the words loaded by LDR literal instructions. '''
+    end = address + len(code)
+    words = struct.unpack('<{}I'.format(len(code) // 4),
+                          code[:len(code) & ~3])
+    flows = []
+    leaders = {address}
+    literals = set()
+
+    for n, word in enumerate(words):
+        pc = address + 4 * n
+        flow, target = disasm.flow(word, pc)
+        flows.append(flow)
+        if target is not None:
+            leaders.add(target)
+        if flow == Disassembler.CONDITIONAL:
+            leaders.add(pc + 4)
+        literal = literal_address(word, pc)
+        if literal is not None:
+            literals.add(literal & ~3)
+
+    leaders = sorted(a for a in leaders - literals
+                     if address <= a < end and not a & 3)
+
+    blocks = []
+    for n, leader in enumerate(leaders):
+        limit = leaders[n + 1] if n + 1 < len(leaders) else end
+        pc = leader
+        while pc < limit:
+            pc += 4
+            if flows[(pc - 4 - address) // 4] != Disassembler.NONE:
+                break
+        blocks.append((leader, pc - leader))
+    return blocks
+
+def write_drcov(f, blocks, address, size, module):
+    ''' drcov (version 2) file of the blocks reached, as a single module '''
+    header = (
+        'DRCOV VERSION: 2\n'
+        'DRCOV FLAVOR: hbootdbg\n'
+        'Module Table: version 2, count 1\n'
+        'Columns: id, base, end, entry, checksum, timestamp, path\n'
+        ' 0, 0x{:08x}, 0x{:08x}, 0x0000000000000000, 0x00000000, '
+        '0x00000000, {}\n'
+        'BB Table: {} bbs\n'
+    ).format(address, address + size, module, len(blocks))
+    f.write(header.encode())
+    for start, block_size in blocks:
+        f.write(struct.pack('<IHH', start - address,
+                            min(block_size, DRCOV_MAX_BLOCK_SIZE), 0))
+
+def write_lcov(f, blocks, reached, address, module):
+    ''' lcov tracefile, there is no source: the "lines" of the module are its
+    instructions, numbered from 1 at address '''
+    lines = []
+    for start, block_size in blocks:
+        hit = 1 if start in reached else 0
+        for pc in range(start, start + block_size, 4):
+            lines.append(((pc - address) // 4 + 1, hit))
+    f.write('TN:\nSF:{}\n'.format(module).encode())
+    for line, hit in lines:
+        f.write('DA:{},{}\n'.format(line, hit).encode())
+    f.write('LF:{}\nLH:{}\nend_of_record\n'.format(
+        len(lines), sum(hit for _, hit in lines)).encode())
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument('address', type=lambda x: int(x, 0))
+    parser.add_argument('size', type=lambda x: int(x, 0))
+    parser.add_argument('-f', '--fastboot-mode', action='store_true')
+    parser.add_argument('--darm', type=str, default='libdarm.so',
+            help='darm shared library')
+    parser.add_argument('-t', '--time', type=float,
+            help='seconds to record for, instead of until enter is pressed')
+    parser.add_argument('-m', '--module', type=str, default='hboot',
+            help='module name in the files exported')
+    parser.add_argument('--drcov', type=argparse.FileType('wb'))
+    parser.add_argument('--lcov', type=argparse.FileType('wb'))
+    args = parser.parse_args()
+
+    disasm = Disassembler(args.darm)
+    dbg = hbootdbg.HbootDbg(fastboot_mode=args.fastboot_mode)
+
+    res = dbg.read(args.address, args.size)
+    hbootdbg.exit_on_error('Reading the code failed', res)
+    blocks = find_blocks(disasm, res.data, args.address)
+
+    res = dbg.coverage(args.address, args.size)
+    hbootdbg.exit_on_error('Starting coverage failed', res)
+    bitmap = res.bitmap
+
+    inserted = dbg.update_breakpoints(dbg.insert_breakpoints,
+                                      [a for a, _ in blocks],
+                                      hbootdbg.BREAKPOINT_COVERAGE)
+    print('{} blocks, {} breakpoints inserted'.format(len(blocks),
+                                                      len(inserted)))
+
+    if args.time is not None:
+        time.sleep(args.time)
+    else:
+        input('Recording, press enter to stop')
+
+    res = dbg.read(bitmap, (args.size // 4 + 7) // 8, compressed=True)
+    hbootdbg.exit_on_error('Reading the coverage bitmap failed', res)
+    reached = set()
+    for start, _ in blocks:
+        n = (start - args.address) // 4
+        if res.data[n // 8] & (1 << (n % 8)):
+            reached.add(start)
+
+    # Breakpoints not hit are still there
+    dbg.update_breakpoints(dbg.remove_breakpoints,
+                           [a for a in inserted if a not in reached],
+                           hbootdbg.BREAKPOINT_COVERAGE)
+    print('{} of {} blocks reached'.format(len(reached), len(blocks)))
+
+    if args.drcov:
+        write_drcov(args.drcov, [b for b in blocks if b[0] in reached],
+                    args.address, args.size, args.module)
+    if args.lcov:
+        write_lcov(args.lcov, blocks, reached, args.address, args.module)
@@ -39,21 +39,74 @@ import serial
 import socket
 import struct
 import sys
-import time
+
+# Signals reported to GDB
+SIGINT = 2
+SIGILL = 4
+SIGTRAP = 5
+SIGKILL = 9
+SIGSEGV = 11
+
+STOP_SIGNAL = {
+    hbootdbg.EVENT_STOP                 : SIGINT,
+    hbootdbg.EVENT_BREAKPOINT           : SIGTRAP,
+    hbootdbg.EVENT_MEMORY_FAULT         : SIGSEGV,
+    hbootdbg.EVENT_ILLEGAL_INSTRUCTION  : SIGILL,
+    hbootdbg.EVENT_RESET                : SIGKILL,
+}
+
+# Granularity of the memory cache, GDB reads are served from whole pages
+CACHE_PAGE_SIZE                 = 1024
+
+# Largest read from the GDB connection
+RECV_SIZE                       = 65536
+
+# Packets ending with binary data, or with arguments parsed by their handler,
+# and the number of separators before it
+BINARY_PACKETS = (
+    (b'X', 2),
+    (b'qSearch:memory:', 4),
+    (b'vCont;', 1),
+    (b'QTDP:', 1),
+)
+
+def packet_key(packet):
+    ''' Dispatch key of a packet: its name for q, Q and v packets, its first
+    byte otherwise '''
+    if packet[:1] in (b'q', b'Q', b'v'):
+        return packet
+    return packet[:1]
 
 class PatternDispatcher:
-    ''' Call handlers according to regular expression matching '''
+    ''' Call handlers according to regular expression matching
+
+    Handlers are looked up by packet key first, the regular expression is only
+    matched against the few handlers sharing that key, to parse arguments. The
+    key is the literal prefix of the regular expression, which must at least
+    start with the packet first byte, or with the whole packet name for q, Q
+    and v packets. '''
 
     def __init__(self):
-        self.handlers = []
+        self.handlers = {}
         self.owner = None
 
     def register(self, regexp, handler):
-        self.handlers.append((
+        # Later registrations take precedence
+        self.handlers.setdefault(self.regexp_key(regexp), []).insert(0, (
             re.compile(regexp),
             handler
         ))
 
+    @staticmethod
+    def regexp_key(regexp):
+        literal = re.match(br'\^((?:\\.|[^\\.^$*+?{}\[\]|()])*)', regexp)
+        prefix = re.sub(br'\\(.)', br'\1', literal.group(1))
+        key = packet_key(prefix)
+        if len(key) == 0 or (prefix[:1] in (b'q', b'Q', b'v') and
+                             regexp[literal.end():] != b'$'):
+            raise ValueError('no packet key in {}'.format(regexp))
+        return key
+
     def registered(self, regexp):
         def decorator(func):
             self.register(regexp, func)
@@ -65,12 +118,82 @@ class PatternDispatcher:
         return self
 
     def dispatch(self, command, *data_list):
-        for cmd_regexp, handler in reversed(self.handlers):
+        for cmd_regexp, handler in self.handlers.get(packet_key(command), ()):
             match = cmd_regexp.match(command)
             if match:
                 return handler(self.owner, match, *data_list)
         return None
 
+class PacketReader:
+    ''' Incremental parser for the GDB remote serial protocol
+
+    Data is fed as it is received, in chunks of any size, and every complete
+    item is returned as a (kind, payload) tuple. kind is the first byte of the
+    item: b'$' for a packet, whose payload is None if the checksum is wrong, or
+    b'+', b'-' and b'\\x03' for acks and interrupts. Escapes and run-length
+    encoding are decoded. '''
+
+    def __init__(self):
+        self._buf = bytearray()
+        # Where to resume looking for the end of an incomplete packet
+        self._scan = 0
+
+    def feed(self, data):
+        buf = self._buf
+        buf += data
+        items = []
+        pos = 0
+        while pos < len(buf):
+            if buf[pos] != ord(b'$'):
+                items.append((bytes(buf[pos:pos + 1]), None))
+                pos += 1
+                continue
+
+            end = buf.find(b'#', max(pos + 1, self._scan))
+            if end < 0 or end + 3 > len(buf):
+                self._scan = len(buf) if end < 0 else end
+                break
+            items.append((b'$', self.decode(buf[pos + 1:end],
+                                            buf[end + 1:end + 3])))
+            pos = end + 3
+
+        del buf[:pos]
+        self._scan = max(self._scan - pos, 0)
+        return items
+
+    @staticmethod
+    def decode(raw, checksum):
+        try:
+            if sum(raw) % 256 != int(checksum, 16):
+                return None
+        except ValueError:
+            return None
+
+        if b'*' not in raw:
+            if b'}' not in raw:
+                return bytes(raw)
+            # The escaped byte can't be a '}', so every part but the first
+            # starts with one
+            parts = bytes(raw).split(b'}')
+            return parts[0] + b''.join(
+                bytes((p[0] ^ 0x20,)) + p[1:] for p in parts[1:] if p)
+
+        out = bytearray()
+        i = 0
+        while i < len(raw):
+            c = raw[i]
+            if c == ord(b'}') and i + 1 < len(raw):
+                out.append(raw[i + 1] ^ 0x20)
+                i += 2
+            elif c == ord(b'*') and out and i + 1 < len(raw):
+                # The previous byte is repeated (count - 29) more times
+                out += out[-1:] * (raw[i + 1] - 29)
+                i += 2
+            else:
+                out.append(c)
+                i += 1
+        return bytes(out)
+
 class TCPServer:
     ''' Class to listen to GDB using TCP as a medium '''
 
@@ -128,12 +251,24 @@ class ARMRegisters:
         if i >= 0 and i <= 15:
             return self._gpr[i]
         elif i >= 16  and i <= 23:
-            return self._fpr[i]
+            return self._fpr[i - 16]
+        elif i == 24:
+            return 0
         elif i == 25:
             return self._cpsr
         else:
             raise ValueError
 
+    def __setitem__(self, i, value):
+        if i >= 0 and i <= 15:
+            self._gpr[i] = value
+        elif i >= 16  and i <= 23:
+            self._fpr[i - 16] = value
+        elif i == 25:
+            self._cpsr = value
+        else:
+            raise ValueError
+
     def cpsr(self):
         return self._cpsr
 
@@ -145,6 +280,21 @@ class ARMRegisters:
         # XXX: to bypass r11 being dereferenced by GDB (considered as fp?)
         self._gpr[11] = 0x8d05e8c0
 
+    @staticmethod
+    def pack_gdb_register(value):
+        ''' GDB expects registers in target byte order '''
+        return '{:08x}'.format(
+            struct.unpack('>I', struct.pack('<I', value))[0]).encode()
+
+    @staticmethod
+    def unpack_gdb_register(data):
+        return struct.unpack('<I', binascii.unhexlify(data))[0]
+
+    def unpack_gdb(self, data):
+        ''' Parse the register block of a G packet, laid out as by pack_gdb '''
+        for i in list(range(24)) + [25]:
+            self[i] = self.unpack_gdb_register(data[i * 8:i * 8 + 8])
+
     def pack_gdb(self):
         data = []
         for r in self._gpr:
@@ -158,6 +308,58 @@ class ARMRegisters:
             struct.unpack('>I', struct.pack('<I', self._cpsr))[0]))
         return ''.join(data).encode()
 
+class MemoryCache:
+    ''' Cache of target memory pages, valid as long as the target is stopped
+    and nothing is written to it '''
+
+    def __init__(self, dbg, page_size=CACHE_PAGE_SIZE):
+        self._dbg = dbg
+        self._page_size = page_size
+        self._pages = {}
+        self.hits = 0
+        self.misses = 0
+
+    def read(self, address, size):
+        first = address & ~(self._page_size - 1)
+        pages = range(first, max(address + size, first + 1), self._page_size)
+        missing = [p for p in pages if p not in self._pages]
+        if missing:
+            self.misses += 1
+            self.fetch(missing)
+        else:
+            self.hits += 1
+
+        if any(p not in self._pages for p in pages):
+            # Part of the range is unreadable, let the debugger tell
+            return self._dbg.read(address, size).data
+        data = b''.join(self._pages[p] for p in pages)
+        return data[address - first:address - first + size]
+
+    def fetch(self, pages):
+        ''' Fetch pages in a single round trip, contiguous ones being read as a
+        single range. Unreadable pages are not cached. '''
+        ranges = []
+        for page in sorted(set(pages)):
+            if ranges and ranges[-1][0] + ranges[-1][1] == page:
+                ranges[-1][1] += self._page_size
+            else:
+                ranges.append([page, self._page_size])
+
+        for i in range(0, len(ranges), hbootdbg.READV_MAX):
+            chunk = ranges[i:i + hbootdbg.READV_MAX]
+            res = self._dbg.readv(chunk)
+            if res.error != hbootdbg.ERROR_SUCCESS:
+                continue
+            for (address, size), data in zip(chunk, res.results):
+                if data is None:
+                    continue
+                for offset in range(0, size, self._page_size):
+                    self._pages[address + offset] = \
+                        data[offset:offset + self._page_size]
+
+    def invalidate(self):
+        self._pages.clear()
+
 class GDBServer:
     ''' GDB server handling requests form the client debugger and routing
     them to the host '''
@@ -171,8 +373,12 @@ class GDBServer:
             ferr=sys.stderr,
             first_run=False,
             fastboot_mode=False,
-            debug=False):
+            debug=False,
+            record=None):
         self._server = server
+        # Everything received from GDB is appended to record, if given, to be
+        # replayed by benchmark.py
+        self._record = record
         self._dbg = hbootdbg.HbootDbg(tty,
                 fastboot_mode=fastboot_mode,
                 debug=debug)
@@ -180,6 +386,24 @@ class GDBServer:
         self._enable_debug = debug
         self._first_run = first_run
         self._r = ARMRegisters()
+        # Registers are fetched once per stop, writes are pushed on resume
+        self._r_valid = False
+        self._r_dirty = {}
+        self._signal = SIGTRAP
+        self._cache = MemoryCache(self._dbg)
+        # qXfer:memory-map:read document, built once per attach
+        self._memory_map = None
+        # Breakpoints to insert and remove when the target resumes, and the
+        # ones inserted with conditions
+        self._bp_insert = set()
+        self._bp_remove = set()
+        self._bp_conditional = set()
+        # Tracepoints by number, downloaded to the device by QTStart
+        self._tracepoints = {}
+        self._tracing = False
+        # Frames collected so far, and the one selected by QTFrame
+        self._frames = None
+        self._frame = None
 
     def debug(self, *args, **kwargs):
         if self._enable_debug:
@@ -188,6 +412,8 @@ class GDBServer:
 
     def read(self, size):
         result = self._server.recv(size)
+        if self._record is not None:
+            self._record.write(result)
         return result
 
     def send(self, *data_list):
@@ -202,33 +428,12 @@ class GDBServer:
         buffer = self._server.recv(len(bytes))
         assert buffer == bytes, '{} != {}'.format(buffer, bytes)
 
-    def unpack(self, data, checksum):
-        checksum = checksum.lower()
-        if (
-            len(checksum) != 2 or
-            not (ord(b'0') <= checksum[0] <= ord(b'f')) or
-            not (ord(b'0') <= checksum[1] <= ord(b'f')) or
-            sum(c for c in data) % 256 != int(checksum, 16)
-        ):
-            return None
-        else:
-            result = []
-            current_word = []
-            escaped = False
-            for i, c in enumerate(data):
-                # TODO: handle length-encoding
-                if escaped:
-                    current_word.append(c ^ 0x20)
-                    escaped = False
-                elif c == b'}':
-                    escaped = True
-                elif c in b',:;':
-                    result.append(bytes(current_word))
-                    current_word = []
-                else:
-                    current_word.append(c)
-            result.append(bytes(current_word))
-            return result
+    def unpack(self, data):
+        ''' Split a decoded packet into its fields '''
+        # The binary data of some packets may contain separators
+        separators = next((n for p, n in BINARY_PACKETS
+                           if data.startswith(p)), 0)
+        return re.split(b'[,:;]', data, maxsplit=separators)
 
     def pack(self, data_list):
         packed_data_list = []
@@ -236,7 +441,7 @@ class GDBServer:
             packed_data = []
             packed_data_list.append(packed_data)
             for c in data:
-                if c in b'$#}':
+                if c in b'$#}*':
                     packed_data.append(ord(b'}'))
                     c ^= 0x20
                 packed_data.append(c)
@@ -252,49 +457,46 @@ class GDBServer:
             self._dbg.attach()
             self._dbg.breakpoint()
         self._server.start()
+        reader = PacketReader()
         while True:
-            packet_type = self.read(1)
-            if len(packet_type) == 0:
+            received = self.read(RECV_SIZE)
+            if len(received) == 0:
                 self.debug('Connection closed')
                 break
 
-            if packet_type == b'$':
-                data = b''
-                while True:
-                    byte = self.read(1)
-                    if byte != b'#':
-                        data += byte
-                    else:
-                        break
-                checksum = self.read(2)
-                data = self.unpack(data, checksum)
-                if data is None:
-                    self.debug('Received corrupted packet:', data)
-                    self.send_raw(b'-')
-                else:
-                    self.debug('Received packet:', data)
-                    self.send_raw(b'+')
-                    if len(data) < 1:
-                        continue
-                    command, data_list = data[0], data[1:]
-                    if not self.DISPATCHER.dispatch(command, *data_list):
-                        self.debug('  -> Unhandled packet')
-                        self.send(b'')
-
-            elif packet_type == b'+':
-                pass
-            elif packet_type == b'-':
-                self.debug('Host received a corrupted packet')
-            elif packet_type == b'\x03':
-                self.debug('Host sent interruption')
-            else:
-                self.debug('Received invalid packet type: {}'.format(packet_type))
+            for packet_type, data in reader.feed(received):
+                self.handle_packet(packet_type, data)
         self._server.stop()
 
+    def handle_packet(self, packet_type, data):
+        if packet_type == b'$':
+            if data is None:
+                self.debug('Received corrupted packet')
+                self.send_raw(b'-')
+                return
+            data = self.unpack(data)
+            self.debug('Received packet:', data)
+            self.send_raw(b'+')
+            command, data_list = data[0], data[1:]
+            if not self.DISPATCHER.dispatch(command, *data_list):
+                self.debug('  -> Unhandled packet')
+                self.send(b'')
+
+        elif packet_type == b'+':
+            pass
+        elif packet_type == b'-':
+            self.debug('Host received a corrupted packet')
+        elif packet_type == b'\x03':
+            self.debug('Host sent interruption')
+        else:
+            self.debug('Received invalid packet type: {}'.format(packet_type))
+
     @DISPATCHER.registered(b'^qSupported$')
     def handle_qsupported(self, cmd_match, *data_list):
         features = [
-            b'PacketSize=1024'
+            b'PacketSize=1024',
+            b'qXfer:memory-map:read+',
+            b'ConditionalBreakpoints+',
         ]
         self.send(*features)
         return True
@@ -322,64 +524,302 @@ class GDBServer:
 
     @DISPATCHER.registered(br'^\?$')
     def handle_get_stop_reason(self, cmd_match, *data_list):
-        self.send(b'S05')
+        self.send('S{:02x}'.format(self._signal).encode())
+        return True
+
+    def send_stop(self, stop):
+        self.debug('Stopped: {} at {:08x}'.format(
+            hbootdbg.EVENT.get(stop.event, stop.event), stop.pc))
+        self._signal = STOP_SIGNAL.get(stop.event, SIGTRAP)
+        self.send('S{:02x}'.format(self._signal).encode())
+
+    def fetch_registers(self):
+        ''' Fetch the registers unless they already were since the target
+        stopped, returns whether they had to be '''
+        if self._r_valid:
+            return False
+        self._r.unpack(self._dbg.get_registers().data)
+        self._r_valid = True
+        return True
+
+    def set_register(self, i, value):
+        ''' Buffer a register write until the target resumes, returns False
+        for registers which can't be written '''
+        if i == 13 or 16 <= i <= 24 or i > 25:
+            return False
+        if self._r[i] != value:
+            self._r[i] = value
+            self._r_dirty[hbootdbg.REGISTER_CPSR if i == 25 else i] = value
         return True
 
+    def resume(self):
+        ''' Issue everything to be done before resuming, to be called within the
+        batch which resumes the target '''
+        self.invalidate_cache()
+        self.flush_breakpoints()
+        if self._r_dirty:
+            self.debug('Writing registers:', self._r_dirty)
+            self._dbg.set_registers(self._r_dirty)
+        self._r_dirty = {}
+        self._r_valid = False
+
     @DISPATCHER.registered(b'^g$')
     def handle_get_registers(self, cmd_match, *data_list):
-        self._r.unpack(self._dbg.get_registers().data)
+        if self._frame is not None:
+            self.send(self.pack_frame_registers(self._frames[self._frame]))
+            return True
+        fetched = self.fetch_registers()
         self.send(self._r.pack_gdb())
+        if fetched:
+            self.prefetch()
+        return True
+
+    @DISPATCHER.registered(b'^G([0-9A-Fa-f]+)$')
+    def handle_set_registers(self, cmd_match, *data_list):
+        self.fetch_registers()
+        registers = ARMRegisters()
+        registers.unpack_gdb(cmd_match.group(1))
+        for i in list(range(24)) + [25]:
+            if registers[i] != self._r[i] and not \
+                    self.set_register(i, registers[i]):
+                self.send(b'E01')
+                return True
+        self.send(b'OK')
         return True
 
+    def prefetch(self):
+        ''' Once it has the registers, GDB reads a burst of small ranges to
+        unwind the stack: fetch the pages around pc, lr and sp with a single
+        readv instead of one round trip per m packet '''
+        self.flush_breakpoints()
+        self._cache.fetch([self._r[i] & ~(CACHE_PAGE_SIZE - 1)
+                           for i in (13, 14, 15)])
+
+    def invalidate_cache(self):
+        ''' To be called whenever the target memory may change '''
+        self.debug('Memory cache: {} hits, {} misses'.format(
+            self._cache.hits, self._cache.misses))
+        self._cache.invalidate()
+
     @DISPATCHER.registered(b'^p([0-9A-Fa-f]+)$')
     def handle_get_register(self, cmd_match, *data_list):
         reg_nbr = int(cmd_match.group(1), 16)
-        self.send('{:08x}'.format(self._r[reg_nbr]).encode())
+        if self._frame is not None:
+            value = self.frame_registers(self._frames[self._frame]).get(reg_nbr)
+            self.send(b'xxxxxxxx' if value is None else
+                      ARMRegisters.pack_gdb_register(value))
+            return True
+        self.fetch_registers()
+        self.send(self._r.pack_gdb_register(self._r[reg_nbr]))
         return True
 
+    @DISPATCHER.registered(b'^P([0-9A-Fa-f]+)=([0-9A-Fa-f]{8})$')
+    def handle_set_register(self, cmd_match, *data_list):
+        reg_nbr = int(cmd_match.group(1), 16)
+        self.fetch_registers()
+        value = self._r.unpack_gdb_register(cmd_match.group(2))
+        self.send(b'OK' if self.set_register(reg_nbr, value) else b'E01')
+        return True
+
+    def do_continue(self):
+        with self._dbg.batch():
+            self.resume()
+            self._dbg.breakpoint_continue()
+        self.send_stop(self._dbg.wait_stop())
+
+    def do_step(self, start=0, end=0):
+        ''' Step once, or until pc leaves [start, end) without going back and
+        forth with the device for each instruction '''
+        with self._dbg.batch():
+            self.resume()
+            res = self._dbg.step(start, end)
+        if res.error != hbootdbg.ERROR_SUCCESS:
+            self.send('E{:02x}'.format(res.error).encode())
+        else:
+            self.send_stop(self._dbg.wait_stop())
+
     @DISPATCHER.registered(b'^c$')
     def handle_continue(self, cmd_match, *data_list):
-        self._dbg.breakpoint_continue()
-        while self._dbg.get_registers().error == hbootdbg.ERROR_NO_BREAKPOINT:
-            time.sleep(0.1)
-        self.send(b'S05')
+        self.do_continue()
         return True
 
     @DISPATCHER.registered(b'^s$')
     def handle_step(self, cmd_match, *data_list):
-        break_pc = self._r[15] + 4
-        print('   => INSERT BP: {:08x}'.format(break_pc))
-        self._dbg.insert_breakpoint(break_pc)
-        self._dbg.breakpoint_continue()
-        while self._dbg.get_registers().error == hbootdbg.ERROR_NO_BREAKPOINT:
-            time.sleep(0.05)
-        print('   => DELETE BP: {:08x}'.format(break_pc))
-        self._dbg.remove_breakpoint(break_pc)
-        self.send(b'S05')
+        self.do_step()
+        return True
+
+    @DISPATCHER.registered(br'^vCont\?$')
+    def handle_vcont_query(self, cmd_match, *data_list):
+        self.send(b'vCont;c;C;s;S;r')
+        return True
+
+    @DISPATCHER.registered(b'^vCont$')
+    def handle_vcont(self, cmd_match, *data_list):
+        # There is a single thread, the first action applies to it. Signals
+        # can't be delivered and are ignored.
+        action = data_list[0].split(b';')[0].split(b':')[0]
+        if action[:1] in (b'c', b'C'):
+            self.do_continue()
+        elif action[:1] in (b's', b'S'):
+            self.do_step()
+        elif action[:1] == b'r':
+            start, end = action[1:].split(b',')
+            self.do_step(int(start, 16), int(end, 16))
+        else:
+            self.send(b'')
         return True
 
     @DISPATCHER.registered(b'^m([0-9A-Fa-f]+)$')
     def handle_read_memory(self, cmd_match, *data_list):
         address = int(cmd_match.group(1), 16)
         size = int(data_list[0], 16)
-        data = self._dbg.read(address, size).data
+        if self._frame is not None:
+            data = self.frame_memory(self._frames[self._frame], address, size)
+            self.send(b'E01' if data is None else binascii.hexlify(data))
+            return True
+        self.flush_breakpoints()
+        data = self._cache.read(address, size)
         self.send(binascii.hexlify(data))
         return True
 
     @DISPATCHER.registered(b'^M([0-9A-Fa-f]+)$')
     def handle_write_memory(self, cmd_match, *data_list):
         address = int(cmd_match.group(1), 16)
-        size = int(data_list[0], 16)
-        data = int(data_list[1], 16)
-        res = self._dbg.write(address, size, data).data
-        self.send(binascii.hexlify(res))
+        data = binascii.unhexlify(data_list[1])
+        self.flush_breakpoints()
+        self.invalidate_cache()
+        self.send_write_result(self._dbg.write_memory(address, data))
+        return True
+
+    @DISPATCHER.registered(b'^X([0-9A-Fa-f]+)$')
+    def handle_write_memory_binary(self, cmd_match, *data_list):
+        address = int(cmd_match.group(1), 16)
+        data = data_list[1]
+        if len(data) == 0:
+            # GDB probing for X packet support
+            self.send(b'OK')
+        else:
+            self.flush_breakpoints()
+            self.invalidate_cache()
+            self.send_write_result(self._dbg.write_memory(address, data))
+        return True
+
+    def send_write_result(self, res):
+        if res.error == hbootdbg.ERROR_SUCCESS:
+            self.send(b'OK')
+        else:
+            self.send('E{:02x}'.format(res.error).encode())
+
+    @DISPATCHER.registered(b'^qSearch$')
+    def handle_search_memory(self, cmd_match, *data_list):
+        if data_list[0] != b'memory':
+            return False
+        address = int(data_list[1], 16)
+        size = int(data_list[2], 16)
+        pattern = data_list[3]
+        if len(pattern) > hbootdbg.SEARCH_MAX_PATTERN:
+            return False
+        self.flush_breakpoints()
+        res = self._dbg.search(address, size, pattern, max_hits=1)
+        if res.error != hbootdbg.ERROR_SUCCESS:
+            self.send('E{:02x}'.format(res.error).encode())
+        elif res.hits:
+            self.send('1,{:x}'.format(res.hits[0]).encode())
+        else:
+            self.send(b'0')
+        return True
+
+    @DISPATCHER.registered(b'^qCRC$')
+    def handle_crc(self, cmd_match, *data_list):
+        address = int(data_list[0], 16)
+        size = int(data_list[1], 16)
+        self.flush_breakpoints()
+        res = self._dbg.checksum(address, size)
+        if res.error != hbootdbg.ERROR_SUCCESS:
+            self.send('E{:02x}'.format(res.error).encode())
+        else:
+            self.send('C{:08x}'.format(res.crcs[0]).encode())
+        return True
+
+    def memory_map(self):
+        ''' GDB memory map of the target, built from the translation table.
+        Adjacent regions of the same GDB type are merged. Sections without
+        access permission are reported as rom, as they can't be written. '''
+        if self._memory_map is not None:
+            return self._memory_map
+        res = self._dbg.memory_map()
+        if res.error != hbootdbg.ERROR_SUCCESS:
+            return None
+
+        merged = []
+        for address, size, type_, ap in res.regions:
+            kind = 'rom' if type_ == hbootdbg.MMU_PAGE_TYPE_SECTION and \
+                ap == 0 else 'ram'
+            if merged and merged[-1][2] == kind and \
+                    merged[-1][0] + merged[-1][1] == address:
+                merged[-1][1] += size
+            else:
+                merged.append([address, size, kind])
+
+        self._memory_map = (
+            '<?xml version="1.0"?>\n'
+            '<!DOCTYPE memory-map PUBLIC "+//IDN gnu.org//DTD GDB Memory Map '
+            'V1.0//EN" "http://sourceware.org/gdb/gdb-memory-map.dtd">\n'
+            '<memory-map>\n' +
+            ''.join('<memory type="{}" start="0x{:x}" length="0x{:x}"/>\n'
+                    .format(kind, address, size)
+                    for address, size, kind in merged) +
+            '</memory-map>\n').encode()
+        return self._memory_map
+
+    @DISPATCHER.registered(b'^qXfer$')
+    def handle_qxfer(self, cmd_match, *data_list):
+        if data_list[:3] != (b'memory-map', b'read', b''):
+            return False
+        offset = int(data_list[3], 16)
+        length = int(data_list[4], 16)
+        document = self.memory_map()
+        if document is None:
+            self.send(b'E01')
+            return True
+        chunk = document[offset:offset + length]
+        more = offset + length < len(document)
+        self.send((b'm' if more else b'l') + chunk)
         return True
 
     @DISPATCHER.registered(b'^Z0$')
     def handle_insert_breakpoint(self, cmd_match, *data_list):
+        ''' GDB removes every breakpoint when the target stops and inserts them
+        back before resuming. Breakpoints without condition are only inserted
+        and removed when the target resumes or its memory is accessed, so that
+        most of them cancel out and the others go in a few commands. '''
         address = int(data_list[0], 16)
         type = int(data_list[1])
-        self._dbg.insert_breakpoint(address)
+        # Conditions are given as "X len,expr" pairs after the kind
+        conditions = [binascii.unhexlify(expr)
+                      for x, expr in zip(data_list[2::2], data_list[3::2])
+                      if x[:1] == b'X']
+
+        if not conditions and address not in self._bp_conditional:
+            if address in self._bp_remove:
+                self._bp_remove.discard(address)
+            else:
+                self._bp_insert.add(address)
+            self.send(b'OK')
+            return True
+
+        # Inserting again replaces the conditions, which can't be deferred
+        self._bp_insert.discard(address)
+        self._bp_remove.discard(address)
+        self.invalidate_cache()
+        res = self._dbg.insert_breakpoint(address, conditions=conditions)
+        if res.error != hbootdbg.ERROR_SUCCESS:
+            self.send('E{:02x}'.format(res.error).encode())
+            return True
+        if conditions:
+            self._bp_conditional.add(address)
+        else:
+            self._bp_conditional.discard(address)
         self.send(b'OK')
         return True
 
@@ -387,14 +827,267 @@ class GDBServer:
     def handle_remove_breakpoint(self, cmd_match, *data_list):
         address = int(data_list[0], 16)
         type = int(data_list[1])
-        self._dbg.remove_breakpoint(address)
+        if address in self._bp_insert:
+            self._bp_insert.discard(address)
+        else:
+            self._bp_remove.add(address)
+        self.send(b'OK')
+        return True
+
+    def flush_breakpoints(self):
+        ''' Insert and remove the breakpoints deferred by Z0 and z0 packets.
+        Errors can't be reported to GDB anymore. '''
+        if not self._bp_insert and not self._bp_remove:
+            return
+        step = hbootdbg.BREAKPOINTS_MAX
+        removed = sorted(self._bp_remove)
+        inserted = sorted(self._bp_insert)
+        self.debug('Removing {} and inserting {} breakpoints'.format(
+            len(removed), len(inserted)))
+        self._bp_conditional -= self._bp_remove
+        self._bp_remove = set()
+        self._bp_insert = set()
+        self.invalidate_cache()
+        with self._dbg.batch():
+            for i in range(0, len(removed), step):
+                self._dbg.remove_breakpoints(removed[i:i + step])
+            for i in range(0, len(inserted), step):
+                self._dbg.insert_breakpoints(inserted[i:i + step])
+
+    @DISPATCHER.registered(b'^qRcmd$')
+    def handle_monitor(self, cmd_match, *data_list):
+        ''' monitor commands, for what the debugger counts without stopping:
+        "ignore ADDRESS COUNT" to resume from the next COUNT hits of the
+        breakpoint at ADDRESS, and "hits [reset]" to list the hits of every
+        breakpoint. GDB's own ignore counts still stop the target. '''
+        words = binascii.unhexlify(data_list[0]).decode(
+            'ascii', 'replace').split()
+
+        if len(words) == 3 and words[0] == 'ignore':
+            try:
+                address, count = int(words[1], 0), int(words[2], 0)
+            except ValueError:
+                self.send(b'E01')
+                return True
+            # A breakpoint GDB just inserted may not be on the device yet.
+            # Deferred removals are left alone: flushing them would reset the
+            # counters of every breakpoint GDB takes out while stopped.
+            if address in self._bp_insert:
+                self._bp_insert.discard(address)
+                self.invalidate_cache()
+                self._dbg.insert_breakpoint(address)
+            res = self._dbg.ignore_count(address, count)
+            if res.error != hbootdbg.ERROR_SUCCESS:
+                self.send('E{:02x}'.format(res.error).encode())
+                return True
+            self.console('Will ignore next {} hits of the breakpoint at '
+                         '0x{:08x}.\n'.format(count, address))
+
+        elif words in (['hits'], ['hits', 'reset']):
+            res = self._dbg.breakpoint_counters(reset=len(words) == 2)
+            if res.error != hbootdbg.ERROR_SUCCESS:
+                self.send('E{:02x}'.format(res.error).encode())
+                return True
+            lines = ['{:>10}  {:<20}  {:>10}  {:>10}\n'.format(
+                'address', 'type', 'hits', 'ignore')]
+            for address, type_, hits, ignore in sorted(res.counters):
+                lines.append('0x{:08x}  {:<20}  {:>10}  {:>10}\n'.format(
+                    address, hbootdbg.BREAKPOINT.get(type_, str(type_)),
+                    hits, ignore))
+            self.console(''.join(lines))
+
+        else:
+            self.console('Usage: monitor ignore ADDRESS COUNT\n'
+                         '       monitor hits [reset]\n')
+
+        self.send(b'OK')
+        return True
+
+    def console(self, text):
+        ''' Print text on the GDB console, before the reply of a qRcmd '''
+        self.send(b'O' + binascii.hexlify(text.encode()))
+
+    @DISPATCHER.registered(b'^QTinit$')
+    def handle_trace_init(self, cmd_match, *data_list):
+        self._tracepoints = {}
+        self.send(b'OK')
+        return True
+
+    @DISPATCHER.registered(b'^QTDP$')
+    def handle_trace_define(self, cmd_match, *data_list):
+        ''' QTDP:n:addr:ena:step:pass[:Xlen,cond][-] defines a tracepoint,
+        QTDP:-n:addr:actions[-] adds to its actions. While-stepping actions
+        (prefixed with S), step and pass counts are not supported. '''
+        fields = data_list[0].split(b':')
+        if fields[0].startswith(b'-'):
+            tracepoint = self._tracepoints[int(fields[0][1:], 16)]
+            actions = b':'.join(fields[2:]).rstrip(b'-')
+            if not actions.startswith(b'S'):
+                tracepoint['actions'] += self.parse_trace_actions(actions)
+        else:
+            tracepoint = {
+                'address': int(fields[1], 16),
+                'enabled': fields[2] == b'E',
+                'conditions': [],
+                'actions': [],
+            }
+            for field in fields[5:]:
+                if field.startswith(b'X'):
+                    expr = field.rstrip(b'-').split(b',')[1]
+                    tracepoint['conditions'].append(binascii.unhexlify(expr))
+            self._tracepoints[int(fields[0], 16)] = tracepoint
         self.send(b'OK')
         return True
 
+    @staticmethod
+    def parse_trace_actions(actions):
+        ''' Translate the R (register mask), M (basereg,offset,size) and X
+        (len,expr) actions of QTDP into debugger actions '''
+        result = []
+        for m in re.finditer(br'R([0-9A-Fa-f]+)|'
+                             br'M(-?[0-9A-Fa-f]+),([0-9A-Fa-f]+),([0-9A-Fa-f]+)|'
+                             br'X([0-9A-Fa-f]+),([0-9A-Fa-f]+)', actions):
+            if m.group(1) is not None:
+                mask = int(m.group(1), 16)
+                # GDB numbers cpsr 25
+                mask = (mask & 0xffff) | \
+                       (1 << hbootdbg.REGISTER_CPSR if mask & (1 << 25) else 0)
+                result.append(hbootdbg.trace_registers(mask))
+            elif m.group(2) is not None:
+                reg = int(m.group(2), 16)
+                result.append(hbootdbg.trace_memory(
+                    int(m.group(3), 16), int(m.group(4), 16),
+                    reg if 0 <= reg < 16 else None))
+            else:
+                result.append(hbootdbg.trace_expression(
+                    binascii.unhexlify(m.group(6))))
+        return result
+
+    @DISPATCHER.registered(b'^QTStart$')
+    def handle_trace_start(self, cmd_match, *data_list):
+        self.invalidate_cache()
+        with self._dbg.batch():
+            for tracepoint in self._tracepoints.values():
+                if not tracepoint['enabled']:
+                    continue
+                self._dbg.insert_breakpoint(tracepoint['address'],
+                        hbootdbg.BREAKPOINT_TRACE, tracepoint['conditions'])
+                self._dbg.set_trace_actions(tracepoint['address'],
+                        tracepoint['actions'])
+            res = self._dbg.trace_start()
+        self._tracing = res.error == hbootdbg.ERROR_SUCCESS
+        self._frames = []
+        self._frame = None
+        self.send(b'OK' if self._tracing else
+                  'E{:02x}'.format(res.error).encode())
+        return True
+
+    @DISPATCHER.registered(b'^QTStop$')
+    def handle_trace_stop(self, cmd_match, *data_list):
+        self.invalidate_cache()
+        with self._dbg.batch():
+            self._dbg.trace_stop()
+            for tracepoint in self._tracepoints.values():
+                if tracepoint['enabled']:
+                    self._dbg.remove_breakpoint(tracepoint['address'],
+                                                hbootdbg.BREAKPOINT_TRACE)
+        self.fetch_trace_frames()
+        self._tracing = False
+        self.send(b'OK')
+        return True
+
+    def fetch_trace_frames(self):
+        ''' Drain the device trace buffer into the frames '''
+        res = self._dbg.trace_dump()
+        if res.error == hbootdbg.ERROR_SUCCESS:
+            self._frames.extend(res.frames)
+
+    @DISPATCHER.registered(b'^qTStatus$')
+    def handle_trace_status(self, cmd_match, *data_list):
+        if self._tracing:
+            self.fetch_trace_frames()
+            self.send('T1;tframes:{:x}'.format(len(self._frames)).encode())
+        elif self._frames is None:
+            self.send(b'T0;tnotrun:0')
+        else:
+            self.send('T0;tstop::0;tframes:{:x}'.format(
+                len(self._frames)).encode())
+        return True
+
+    @DISPATCHER.registered(b'^QTFrame$')
+    def handle_trace_frame(self, cmd_match, *data_list):
+        if self._tracing:
+            self.fetch_trace_frames()
+        frames = self._frames or []
+        start = 0 if self._frame is None else self._frame + 1
+
+        if data_list[0] == b'pc':
+            address = int(data_list[1], 16)
+            match = lambda pc: pc == address
+        elif data_list[0] == b'tdp':
+            number = int(data_list[1], 16)
+            tracepoint = self._tracepoints.get(number, {})
+            match = lambda pc: pc == tracepoint.get('address')
+        elif data_list[0] in (b'range', b'outside'):
+            low, high = int(data_list[1], 16), int(data_list[2], 16)
+            inside = data_list[0] == b'range'
+            match = lambda pc: (low <= pc <= high) == inside
+        else:
+            number = int(data_list[0], 16)
+            start = number if number < len(frames) else len(frames)
+            match = lambda pc: True
+
+        self._frame = next((i for i in range(start, len(frames))
+                            if match(frames[i][0])), None)
+        if self._frame is None:
+            self.send(b'F-1')
+        else:
+            self.send('F{:x}T{:x}'.format(self._frame, self.tracepoint_number(
+                frames[self._frame][0])).encode())
+        return True
+
+    def tracepoint_number(self, address):
+        return next((n for n, t in self._tracepoints.items()
+                     if t['address'] == address), 0)
+
+    @staticmethod
+    def frame_registers(frame):
+        ''' Registers collected in a trace frame, by GDB number '''
+        registers = {}
+        for type_, mask, data in frame[1]:
+            if type_ != hbootdbg.TRACE_BLOCK_REGISTERS:
+                continue
+            values = iter(struct.unpack('<{}I'.format(len(data) // 4), data))
+            for i in range(17):
+                if mask & (1 << i):
+                    registers[25 if i == hbootdbg.REGISTER_CPSR else i] = \
+                        next(values)
+        return registers
+
+    def pack_frame_registers(self, frame):
+        registers = self.frame_registers(frame)
+        return b''.join(
+            ARMRegisters.pack_gdb_register(registers[i]) if i in registers
+            else b'xxxxxxxx' for i in range(26))
+
+    @staticmethod
+    def frame_memory(frame, address, size):
+        ''' Memory collected in a trace frame, None unless a single block
+        holds the whole range '''
+        for type_, start, data in frame[1]:
+            if type_ == hbootdbg.TRACE_BLOCK_MEMORY and \
+                    start <= address and address + size <= start + len(data):
+                return data[address - start:address - start + size]
+        return None
+
     @DISPATCHER.registered(b'^D$')
     def handle_detach(self, cmd_match, *data_list):
         #self._dbg.breakpoint_continue()
-        self._dbg.detach()
+        with self._dbg.batch():
+            self.resume()
+            self._dbg.detach()
+        self._memory_map = None
+        self._bp_conditional = set()
         return True
 
 if __name__ == '__main__':
@@ -404,15 +1097,21 @@ if __name__ == '__main__':
     parser.add_argument('-r', '--first-run', action='store_true')
     parser.add_argument('-f', '--fastboot-mode', action='store_true')
     parser.add_argument('-d', '--debug', action='store_true')
+    parser.add_argument('--record', type=argparse.FileType('wb'),
+            help='save the packets sent by GDB to this file')
     args = parser.parse_args()
 
     server = TCPServer(args.listen, args.port)
     proxy = GDBServer(server,
                 first_run=args.first_run,
                 fastboot_mode=args.fastboot_mode,
-                debug=args.debug)
+                debug=args.debug,
+                record=args.record)
 
     try:
         proxy.run()
     except KeyboardInterrupt as e:
         pass
+    finally:
+        if args.record is not None:
+            args.record.close()
@@ -31,13 +31,36 @@
 # SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 import binascii
+import struct
 import sys
 import time
 from serial import Serial
 
+##
+# Debugger response framing (see response in src/hbootdbg/dbg.h)
+##
+
+RESPONSE_MAGIC = b'\x9d\xdb'
+RESPONSE_HEADER = struct.Struct('<HHBBHI')
+RESPONSE_MORE = 1 << 0
+RESPONSE_TIMEOUT = 5
+
+# Frames with this sequence number are unsolicited events
+EVENT_SEQ = 0
+
+def merge_frames(frames):
+    ''' Merge the frames of a response split in several parts, the header of
+    the last one is kept '''
+    return frames[-1][:RESPONSE_HEADER.size] + \
+        b''.join(frame[RESPONSE_HEADER.size:] for frame in frames)
+
 class SerialClient:
     def __init__(self, tty='/dev/ttyUSB0', blocking_io=True):
-        self._s = Serial(tty, 9600, timeout=0.1)
+        if isinstance(tty, str):
+            self._s = Serial(tty, 9600, timeout=0.1)
+        else:
+            # Already opened serial-like object, e.g. a simulated device
+            self._s = tty
         self._blocking_io = blocking_io
 
     def close(self):
@@ -64,6 +87,8 @@ class HbootClient(SerialClient):
         super().__init__(tty, blocking_io)
         self._fastboot_mode = fastboot_mode
         self._debug = debug
+        self._rx = bytearray()
+        self._events = []
 
     def raw(self, data):
         self.write(data)
@@ -75,7 +100,11 @@ class HbootClient(SerialClient):
         data = self.read(1000)
         return (data[:4], data[4:])
 
-    def hbootdbg(self, cmd):
+    def hbootdbg(self, cmd, seq):
+        self.hbootdbg_send(cmd)
+        return self.hbootdbg_recv(seq)
+
+    def hbootdbg_send(self, cmd):
         if self._debug:
             print(b'plain: ' + cmd)
         cmd = binascii.b2a_base64(cmd)[:-1]
@@ -85,27 +114,84 @@ class HbootClient(SerialClient):
             self.write(b'keytest ' + cmd + b'\n')
         if self._debug:
             print(b'send: ' + cmd)
-        data = b''
+
+    def hbootdbg_recv(self, seq):
+        frames = []
         while True:
-            tmp = self.read(1024)
-            if not tmp:
+            data = self.read_frame()
+            if not data:
+                return data
+            (_, frame_seq, _, _, flags, _) = RESPONSE_HEADER.unpack_from(data)
+            if frame_seq != seq:
+                if self._debug:
+                    print(b'stale: ' + data)
+                continue
+            frames.append(data)
+            if not flags & RESPONSE_MORE:
                 break
-            data += tmp
+        data = merge_frames(frames)
         if self._debug:
             print(b'recv: ' + data)
-        if not self._fastboot_mode:
-            # In hboot mode, command is echoed by the phone and it also adds the
-            # hboot prompt at the end of the response. But we have to be careful
-            # when entering a breakpoint, these additions are not there anymore,
-            # we receive the raw responses
-            data = data.split(b'\r\n')
-            data = b'\r\n'.join(
-                    data[1 if data[0].startswith(b'keytest') else None:
-                    -1 if data[-1].endswith(b'hboot>') else None])
-        if self._debug:
-            print(b'stripped: ' + data)
         return data
 
+    def read_frame(self, timeout=RESPONSE_TIMEOUT):
+        ''' Read a single framed response, events received meanwhile are
+        queued for wait_event(). Returns b'' on timeout. '''
+        while True:
+            data = self._read_frame(timeout)
+            if not data or RESPONSE_HEADER.unpack_from(data)[1] != EVENT_SEQ:
+                return data
+            self._events.append(data)
+
+    def wait_event(self, timeout=None):
+        ''' Wait for an unsolicited event, forever if timeout is None. Returns
+        b'' on timeout. '''
+        deadline = None if timeout is None else time.time() + timeout
+        while not self._events:
+            remaining = 1 if deadline is None else deadline - time.time()
+            if remaining <= 0:
+                return b''
+            data = self._read_frame(remaining)
+            if not data:
+                continue
+            if RESPONSE_HEADER.unpack_from(data)[1] == EVENT_SEQ:
+                self._events.append(data)
+            elif self._debug:
+                print(b'stale: ' + data)
+        return self._events.pop(0)
+
+    def clear_events(self):
+        self._events = []
+
+    def _read_frame(self, timeout):
+        ''' Read a single frame. Anything before the magic is
+        dropped: in hboot mode the command is echoed by the phone and the hboot
+        prompt is appended once the command returns, but when entering a
+        breakpoint these additions are not there anymore. '''
+        deadline = time.time() + timeout
+        while True:
+            start = self._rx.find(RESPONSE_MAGIC)
+            if start < 0:
+                # Keep a trailing byte, it may be the start of the magic
+                del self._rx[:-1]
+                missing = RESPONSE_HEADER.size
+            else:
+                del self._rx[:start]
+                missing = RESPONSE_HEADER.size - len(self._rx)
+                if missing <= 0:
+                    size = RESPONSE_HEADER.unpack_from(self._rx)[-1]
+                    end = RESPONSE_HEADER.size + size
+                    if len(self._rx) >= end:
+                        data = bytes(self._rx[:end])
+                        del self._rx[:end]
+                        return data
+                    missing = end - len(self._rx)
+            tmp = self.read(missing)
+            if tmp:
+                self._rx += tmp
+            elif time.time() > deadline:
+                return b''
+
     def preloader(self, cmd):
         if self._fastboot_mode:
             self.write(b'oem ' + cmd)
@@ -32,11 +32,12 @@
 
 import argparse
 import binascii
+import contextlib
 import os
 import struct
 import sys
 import time
-from hboot import HbootClient
+from hboot import HbootClient, RESPONSE_HEADER, merge_frames
 
 ##
 # Commands
@@ -52,6 +53,29 @@ COMMAND = {
     'remove_breakpoint' : 6,
     'breakpoint_continue' : 7,
     'get_registers'     : 8,
+    'write_begin'       : 9,
+    'write_data'        : 10,
+    'batch'             : 11,
+    'read_rle'          : 12,
+    'event'             : 13,
+    'search'            : 14,
+    'checksum'          : 15,
+    'readv'             : 16,
+    'set_registers'     : 17,
+    'step'              : 18,
+    'memory_map'        : 19,
+    'trace_actions'     : 20,
+    'trace_start'       : 21,
+    'trace_stop'        : 22,
+    'trace_dump'        : 23,
+    'insert_breakpoints': 24,
+    'remove_breakpoints': 25,
+    'coverage'          : 26,
+    'profile_start'     : 27,
+    'profile_stop'      : 28,
+    'profile_dump'      : 29,
+    'ignore_count'      : 30,
+    'breakpoint_counters': 31,
 
     # Debug
     'call'              : 50,
@@ -72,6 +96,10 @@ ERROR_BREAKPOINT_ALREADY_EXISTS = 4
 ERROR_NO_BREAKPOINT             = 5
 ERROR_NO_MEMORY_AVAILABLE       = 6
 ERROR_UNMAPPED_MEMORY           = 7
+ERROR_UNSUPPORTED               = 8
+
+# Host side only, no response was received from the device
+ERROR_TIMEOUT                   = 0xff
 
 ERROR = {
     ERROR_SUCCESS               : 'SUCCESS',
@@ -82,6 +110,26 @@ ERROR = {
     ERROR_NO_BREAKPOINT         : 'NO_BREAKPOINT',
     ERROR_NO_MEMORY_AVAILABLE   : 'NO_MEMORY_AVAILABLE',
     ERROR_UNMAPPED_MEMORY       : 'UNMAPPED_MEMORY',
+    ERROR_UNSUPPORTED           : 'UNSUPPORTED',
+    ERROR_TIMEOUT               : 'TIMEOUT',
+}
+
+##
+# Events
+##
+
+EVENT_STOP                      = 0
+EVENT_BREAKPOINT                = 1
+EVENT_MEMORY_FAULT              = 2
+EVENT_ILLEGAL_INSTRUCTION       = 3
+EVENT_RESET                     = 4
+
+EVENT = {
+    EVENT_STOP                  : 'STOP',
+    EVENT_BREAKPOINT            : 'BREAKPOINT',
+    EVENT_MEMORY_FAULT          : 'MEMORY_FAULT',
+    EVENT_ILLEGAL_INSTRUCTION   : 'ILLEGAL_INSTRUCTION',
+    EVENT_RESET                 : 'RESET',
 }
 
 ##
@@ -90,12 +138,61 @@ ERROR = {
 
 BREAKPOINT_NORMAL               = 0
 BREAKPOINT_TRACE                = 1
+BREAKPOINT_COVERAGE             = 3
+BREAKPOINT_PROFILE              = 4
 
 BREAKPOINT = {
     BREAKPOINT_NORMAL           : 'BREAKPOINT_NORMAL',
     BREAKPOINT_TRACE            : 'BREAKPOINT_TRACE',
+    BREAKPOINT_COVERAGE         : 'BREAKPOINT_COVERAGE',
+    BREAKPOINT_PROFILE          : 'BREAKPOINT_PROFILE',
 }
 
+##
+# Limits
+##
+
+# Largest payload sent in a single command, the debugger decodes commands in a
+# 1024 bytes buffer
+WRITE_CHUNK_SIZE                = 512
+
+# Largest packed batch, keeps the base64 encoded command under 1024 bytes
+BATCH_SIZE                      = 700
+
+# See search.h and dbg.h
+SEARCH_MAX_PATTERN              = 128
+SEARCH_MAX_HITS                 = 255
+
+# Index of cpsr for set_registers(), r0-r15 being 0-15. sp can't be written,
+# and only the condition flags of cpsr.
+REGISTER_CPSR                   = 16
+
+# Most ranges read by a single readv, keeps the command under BATCH_SIZE bytes
+READV_MAX                       = (BATCH_SIZE - 8) // 8
+
+# Most addresses of a single insert_breakpoints or remove_breakpoints
+BREAKPOINTS_MAX                 = (BATCH_SIZE - 12) // 4
+
+# Region types of memory_map(), see mmu.h
+MMU_PAGE_TYPE_COARSE            = 1
+MMU_PAGE_TYPE_SECTION           = 2
+MMU_PAGE_TYPE_FINE              = 3
+MMU_PAGE_SECTION_SHIFT          = 20
+
+MMU_REGION                      = struct.Struct('<HHBBH')
+
+# Trace frames and their blocks, see trace.h
+TRACE_FRAME                     = struct.Struct('<II')
+TRACE_BLOCK                     = struct.Struct('<BBHI')
+TRACE_BLOCK_REGISTERS           = ord('R')
+TRACE_BLOCK_MEMORY              = ord('M')
+
+# Counters of a profiled function, see dbg.h
+PROFILE_ENTRY                   = struct.Struct('<IIQ')
+
+# Counters of a breakpoint, see dbg.h
+BREAKPOINT_COUNTER              = struct.Struct('<IB3xII')
+
 ##
 # Commands packing/unpacking
 ##
@@ -109,9 +206,41 @@ class Command:
             breakpoint_type = 0,
             data = None,
             args = (0, 0, 0, 0),
-            time_ = 0):
+            time_ = 0,
+            seq = 0,
+            offset = 0,
+            entries = (),
+            pattern = b'',
+            mask = None,
+            max_hits = 0,
+            block_size = 0,
+            ranges = (),
+            addresses = (),
+            registers = None,
+            start = 0,
+            end = 0,
+            conditions = (),
+            actions = b'',
+            count = 0,
+            reset = False):
         self.type = type
         self.error = error
+        self.seq = seq
+        self.offset = offset
+        self.entries = entries
+        self.pattern = pattern
+        self.mask = mask
+        self.max_hits = max_hits
+        self.block_size = block_size
+        self.ranges = ranges
+        self.addresses = addresses
+        self.registers = registers
+        self.start = start
+        self.end = end
+        self.conditions = conditions
+        self.actions = actions
+        self.count = count
+        self.reset = reset
         self.address = address
         self.size = size
         self.breakpoint_type = breakpoint_type
@@ -122,25 +251,59 @@ class Command:
     def pack(self):
         packed =  struct.pack('B', self.type)
         packed += struct.pack('B', self.error)
+        packed += struct.pack('H', self.seq)
 
-        if self.type == COMMAND['read']:
+        if self.type in (COMMAND['read'], COMMAND['read_rle']):
             packed += struct.pack('I', self.address)
             packed += struct.pack('I', self.size)
 
         elif self.type == COMMAND['write']:
             packed += struct.pack('I', self.address)
             packed += struct.pack('I', self.size)
-            # XXX: Can only write 4 bytes at a time
-            packed += struct.pack('>I', self.data)
+            if isinstance(self.data, int):
+                packed += struct.pack('>I', self.data)
+            else:
+                packed += self.data
+
+        elif self.type == COMMAND['write_begin']:
+            packed += struct.pack('I', self.address)
+            packed += struct.pack('I', self.size)
+
+        elif self.type == COMMAND['write_data']:
+            packed += struct.pack('I', self.offset)
+            packed += struct.pack('I', len(self.data))
+            packed += self.data
 
         elif self.type == COMMAND['insert_breakpoint']:
+            conditions = b''.join(struct.pack('H', len(c)) + c
+                                  for c in self.conditions)
             packed += struct.pack('I', self.address)
             packed += struct.pack('I', self.breakpoint_type)
+            packed += struct.pack('I', len(conditions))
+            packed += conditions
 
         elif self.type == COMMAND['remove_breakpoint']:
             packed += struct.pack('I', self.address)
             packed += struct.pack('I', self.breakpoint_type)
 
+        elif self.type in (COMMAND['insert_breakpoints'],
+                           COMMAND['remove_breakpoints']):
+            packed += struct.pack('I', len(self.addresses))
+            packed += struct.pack('I', self.breakpoint_type)
+            for address in self.addresses:
+                packed += struct.pack('I', address)
+
+        elif self.type == COMMAND['coverage']:
+            packed += struct.pack('I', self.address)
+            packed += struct.pack('I', self.size)
+
+        elif self.type == COMMAND['ignore_count']:
+            packed += struct.pack('I', self.address)
+            packed += struct.pack('I', self.count)
+
+        elif self.type == COMMAND['breakpoint_counters']:
+            packed += struct.pack('I', 1 if self.reset else 0)
+
         elif self.type == COMMAND['call']:
             packed += struct.pack('I', self.address)
             packed += struct.pack('I', self.args[0])
@@ -151,26 +314,207 @@ class Command:
         elif self.type == COMMAND['flashlight']:
             packed += struct.pack('I', self.time_)
 
+        elif self.type == COMMAND['search']:
+            packed += struct.pack('I', self.address)
+            packed += struct.pack('I', self.size)
+            packed += struct.pack('H', len(self.pattern))
+            packed += struct.pack('B', self.mask is not None)
+            packed += struct.pack('B', self.max_hits)
+            packed += self.pattern
+            if self.mask is not None:
+                packed += self.mask
+
+        elif self.type == COMMAND['checksum']:
+            packed += struct.pack('I', self.address)
+            packed += struct.pack('I', self.size)
+            packed += struct.pack('I', self.block_size)
+
+        elif self.type == COMMAND['readv']:
+            packed += struct.pack('I', len(self.ranges))
+            for address, size in self.ranges:
+                packed += struct.pack('I', address)
+                packed += struct.pack('I', size)
+
+        elif self.type == COMMAND['step']:
+            packed += struct.pack('I', self.start)
+            packed += struct.pack('I', self.end)
+
+        elif self.type == COMMAND['set_registers']:
+            packed += struct.pack('I', sum(1 << i for i in self.registers))
+            for i in sorted(self.registers):
+                packed += struct.pack('I', self.registers[i])
+
+        elif self.type == COMMAND['trace_actions']:
+            packed += struct.pack('I', self.address)
+            packed += struct.pack('I', len(self.actions))
+            packed += self.actions
+
+        elif self.type == COMMAND['batch']:
+            entries = b''.join(self.entries)
+            packed += struct.pack('I', len(self.entries))
+            packed += struct.pack('I', len(entries))
+            packed += entries
+
         return packed
 
     def unpack(self, packed):
-        self.type = struct.unpack_from('B', packed, offset=0)[0]
-        self.error = struct.unpack_from('B', packed, offset=1)[0]
+        if len(packed) < RESPONSE_HEADER.size:
+            self.error = ERROR_TIMEOUT
+            return self
+
+        (_, self.seq, self.type, self.error, _, _) = \
+            RESPONSE_HEADER.unpack_from(packed)
+        data = packed[RESPONSE_HEADER.size:]
 
         if self.type == COMMAND['read']:
-            self.data = packed[2:]
+            self.data = data
 
-        if self.type == COMMAND['write']:
-            self.data = packed[2:]
+        if self.type == COMMAND['read_rle']:
+            self.data = rle_decompress(data)
+
+        if self.type in (COMMAND['write'],
+                         COMMAND['write_begin'],
+                         COMMAND['write_data']):
+            self.data = data
 
         if self.type == COMMAND['breakpoint']:
-            self.data = packed[2:]
+            self.data = data
 
         if self.type == COMMAND['get_registers']:
-            self.data = packed[2:]
+            self.data = data
+
+        if self.type == COMMAND['batch']:
+            self.data = data
+
+        if self.type == COMMAND['search']:
+            self.hits = [h for h, in struct.iter_unpack('I', data)]
+            self.data = data
+
+        if self.type == COMMAND['checksum']:
+            self.crcs = [c for c, in struct.iter_unpack('I', data)]
+            self.data = data
+
+        if self.type == COMMAND['readv']:
+            # Error of every range, then the data of the readable ones
+            count = len(self.ranges)
+            offset = (count + 3) & ~3
+            self.errors = list(data[:count])
+            self.results = []
+            for (_, size), error in zip(self.ranges, self.errors):
+                if error == ERROR_SUCCESS:
+                    self.results.append(data[offset:offset + size])
+                    offset += size
+                else:
+                    self.results.append(None)
+            self.data = data
+
+        if self.type in (COMMAND['insert_breakpoints'],
+                         COMMAND['remove_breakpoints']):
+            # Bitmap of the addresses done
+            self.done = [bool(data[i // 8] & (1 << (i % 8)))
+                         if i // 8 < len(data) else False
+                         for i in range(len(self.addresses))]
+            self.data = data
+
+        if self.type == COMMAND['coverage']:
+            if len(data) >= 4:
+                self.bitmap = struct.unpack_from('I', data)[0]
+            self.data = data
+
+        if self.type == COMMAND['profile_dump']:
+            self.functions = list(PROFILE_ENTRY.iter_unpack(data))
+            self.data = data
+
+        if self.type == COMMAND['breakpoint_counters']:
+            self.counters = list(BREAKPOINT_COUNTER.iter_unpack(data))
+            self.data = data
+
+        if self.type == COMMAND['memory_map']:
+            self.regions = [
+                (section << MMU_PAGE_SECTION_SHIFT,
+                 count << MMU_PAGE_SECTION_SHIFT,
+                 type_, ap)
+                for section, count, type_, ap, _
+                in MMU_REGION.iter_unpack(data)
+            ]
+            self.data = data
+
+        if self.type == COMMAND['trace_dump']:
+            # (pc, [(block type, address, data)]) from the oldest frame
+            self.frames = []
+            offset = 0
+            while offset + TRACE_FRAME.size <= len(data):
+                size, pc = TRACE_FRAME.unpack_from(data, offset)
+                blocks = []
+                block = offset + TRACE_FRAME.size
+                while block + TRACE_BLOCK.size <= offset + size:
+                    type_, _, block_size, address = \
+                        TRACE_BLOCK.unpack_from(data, block)
+                    block += TRACE_BLOCK.size
+                    blocks.append((type_, address,
+                                   data[block:block + block_size]))
+                    block += (block_size + 3) & ~3
+                self.frames.append((pc, blocks))
+                offset += size
+            self.data = data
+
+        if self.type == COMMAND['event']:
+            (self.event, self.pc, self.cpsr) = struct.unpack_from('III', data)
+            self.data = data
 
         return self
 
+def rle_decompress(data):
+    ''' Decode the output of rle_compress() (see src/hbootdbg/rle.h) '''
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        c = data[i]
+        if c < 0x80:
+            out += data[i + 1:i + c + 2]
+            i += c + 2
+        else:
+            out += data[i + 1:i + 5] * ((c & 0x7f) + 2)
+            i += 5
+    return bytes(out)
+
+def crc32(data, crc=0xffffffff):
+    ''' CRC-32 as computed by the debugger and by GDB for qCRC (MSB first,
+    no final inversion) '''
+    for b in data:
+        crc ^= b << 24
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x04c11db7 if crc & 0x80000000 else crc << 1)
+            crc &= 0xffffffff
+    return crc
+
+def trace_registers(mask):
+    ''' Tracepoint action collecting the registers of mask, bits 0-15 for
+    r0-r15 and bit REGISTER_CPSR for cpsr '''
+    return struct.pack('<BBHI', ord('R'), 0, 0, mask)
+
+def trace_memory(address, size, reg=None):
+    ''' Tracepoint action collecting memory at address, relative to register
+    reg if given '''
+    return struct.pack('<BBHI', ord('M'), 0xff if reg is None else reg, size,
+                       address & 0xffffffff)
+
+def trace_expression(code):
+    ''' Tracepoint action collecting the memory recorded by the trace bytecodes
+    of a GDB agent expression '''
+    packed = struct.pack('<BBHI', ord('X'), 0, len(code), 0) + code
+    return packed + b'\0' * (-len(packed) % 4)
+
+def batch_entry(packed):
+    ''' Pack a command as an entry of a batch '''
+    padding = b'\0' * (-len(packed) % 4)
+    return struct.pack('I', len(packed)) + packed + padding
+
+def exit_on_error(message, res):
+    ''' Leave a script if the command of res failed '''
+    if res.error != ERROR_SUCCESS:
+        sys.exit('{}: {}'.format(message, ERROR.get(res.error, res.error)))
+
 ##
 # HbootDbg interface
 ##
@@ -180,6 +524,7 @@ class HbootDbg:
     def __init__(self, tty='/dev/ttyUSB0',
                        fastboot_mode=True,
                        debug=False):
+        # tty is either a device path or an opened serial-like object
         not_connected = True
         sys.stderr.write("Waiting for device...")
         sys.stderr.flush()
@@ -194,66 +539,331 @@ class HbootDbg:
             except Exception as e:
                 time.sleep(1)
         sys.stderr.write("\r                     \r")
+        self._seq = 0
+        self._batch = None
+        self._checksums = {}
+
+    def _next_seq(self):
+        # Sequence number 0 is never used, so that stale or unsolicited
+        # responses can't be mistaken for the answer to a command
+        self._seq = self._seq % 0xffff + 1
+        return self._seq
+
+    def _execute(self, cmd):
+        cmd.seq = self._next_seq()
+        # Some responses can only be decoded knowing the request
+        result = Command(cmd.type, ranges=cmd.ranges,
+                         addresses=cmd.addresses)
+        if self._batch is not None:
+            self._batch.append((cmd, result))
+            return result
+        return result.unpack(self._client.hbootdbg(cmd.pack(), cmd.seq))
+
+    @contextlib.contextmanager
+    def batch(self):
+        ''' Queue every command issued inside the context and send them in as
+        few round trips as possible when leaving it. Queued calls return a
+        Command which is only filled in once the batch has been flushed. '''
+        if self._batch is not None:
+            yield self
+            return
+        self._batch = []
+        try:
+            yield self
+            queued = self._batch
+        finally:
+            self._batch = None
+
+        while queued:
+            entries = []
+            size = 0
+            while queued:
+                size += len(batch_entry(queued[0][0].pack()))
+                if entries and size > BATCH_SIZE:
+                    break
+                entries.append(queued.pop(0))
+            self._flush_batch(entries)
+
+    def _flush_batch(self, entries):
+        cmd = Command(COMMAND['batch'],
+                entries=[batch_entry(c.pack()) for c, _ in entries],
+                seq=self._next_seq())
+        self._client.hbootdbg_send(cmd.pack())
+
+        # Every sub-command answers with its own frame, the batch frame comes
+        # last and holds the error code of every entry
+        frames = {}
+        while True:
+            data = self._client.read_frame()
+            if not data:
+                break
+            seq = RESPONSE_HEADER.unpack_from(data)[1]
+            if seq == cmd.seq:
+                break
+            frames.setdefault(seq, []).append(data)
+        errors = Command().unpack(data)
+
+        for i, (c, pending) in enumerate(entries):
+            if c.seq in frames:
+                pending.unpack(merge_frames(frames[c.seq]))
+            if errors.error != ERROR_SUCCESS:
+                pending.error = errors.error
+            elif i < len(errors.data):
+                pending.error = errors.data[i]
 
     def attach(self):
         cmd = Command(COMMAND['attach'])
-        return Command().unpack(self._client.hbootdbg(cmd.pack()))
+        return self._execute(cmd)
 
     def detach(self):
         cmd = Command(COMMAND['detach'])
-        return Command().unpack(self._client.hbootdbg(cmd.pack()))
+        return self._execute(cmd)
 
-    def read(self, address, size):
-        cmd = Command(COMMAND['read'],
+    def read(self, address, size, compressed=False):
+        ''' Read memory. When compressed is set, the debugger compresses the
+        data before sending it, which pays off for large dumps. '''
+        cmd = Command(COMMAND['read_rle' if compressed else 'read'],
                 address=address,
                 size=size)
-        return Command().unpack(self._client.hbootdbg(cmd.pack()))
+        return self._execute(cmd)
+
+    def readv(self, ranges):
+        ''' Read up to READV_MAX (address, size) ranges in one round trip. The
+        data of each range is in the results attribute, None for the ranges
+        which could not be read. '''
+        cmd = Command(COMMAND['readv'], ranges=tuple(ranges))
+        return self._execute(cmd)
+
+    def memory_map(self):
+        ''' Mapped regions of the translation table, as (address, size, type,
+        ap) tuples in the regions attribute. ap is 0 for page tables. '''
+        cmd = Command(COMMAND['memory_map'])
+        return self._execute(cmd)
+
+    def search(self, address, size, pattern, mask=None,
+               max_hits=SEARCH_MAX_HITS):
+        ''' Look for pattern in [address, address + size), the addresses of
+        the hits are returned in the hits attribute. Bits cleared in mask are
+        ignored. Unmapped sections are skipped. '''
+        cmd = Command(COMMAND['search'],
+                address=address,
+                size=size,
+                pattern=pattern,
+                mask=mask,
+                max_hits=max_hits)
+        return self._execute(cmd)
+
+    def checksum(self, address, size, block_size=0):
+        ''' CRC-32 of [address, address + size) computed by the debugger, or
+        of each block_size bytes of it. The CRCs are in the crcs attribute. '''
+        cmd = Command(COMMAND['checksum'],
+                address=address,
+                size=size,
+                block_size=block_size)
+        return self._execute(cmd)
+
+    def changed_blocks(self, address, size, block_size):
+        ''' Addresses of the blocks of the range whose CRC changed since the
+        previous call for the same range. Every block is reported the first
+        time. Returns None if the range can't be read. '''
+        cmd = self.checksum(address, size, block_size)
+        if cmd.error != 0:
+            return None
+
+        key = (address, size, block_size)
+        previous = self._checksums.get(key, ())
+        self._checksums[key] = cmd.crcs
+
+        return [address + i * block_size
+                for i, crc in enumerate(cmd.crcs)
+                if i >= len(previous) or previous[i] != crc]
 
     def write(self, address, size, data):
         cmd = Command(COMMAND['write'],
                 address=address,
                 size=size,
                 data=data)
-        return Command().unpack(self._client.hbootdbg(cmd.pack()))
-
-    def insert_breakpoint(self, address, type=BREAKPOINT_NORMAL):
+        return self._execute(cmd)
+
+    def write_memory(self, address, data):
+        ''' Write a bytes object to memory. Data not fitting in a single command
+        is streamed in chunks, each acknowledged before the next is sent since
+        HBOOT may merge commands queued back to back. Caches are only
+        synchronized once the whole range has been written. '''
+        if len(data) <= WRITE_CHUNK_SIZE:
+            return self.write(address, len(data), data)
+
+        if self._batch is not None:
+            # Streams can't be batched, queue plain writes instead
+            for offset in range(0, len(data), WRITE_CHUNK_SIZE):
+                chunk = data[offset:offset + WRITE_CHUNK_SIZE]
+                res = self.write(address + offset, len(chunk), chunk)
+            return res
+
+        res = self._execute(Command(COMMAND['write_begin'],
+                address=address,
+                size=len(data)))
+        for offset in range(0, len(data), WRITE_CHUNK_SIZE):
+            if res.error != ERROR_SUCCESS:
+                break
+            cmd = Command(COMMAND['write_data'],
+                    offset=offset,
+                    data=data[offset:offset + WRITE_CHUNK_SIZE])
+            res = self._execute(cmd)
+        return res
+
+    def insert_breakpoint(self, address, type=BREAKPOINT_NORMAL,
+                          conditions=()):
+        ''' The target only stops on the breakpoint if any of the conditions,
+        GDB agent expressions evaluated by the debugger, is true. Inserting an
+        existing breakpoint replaces its conditions. '''
         cmd = Command(COMMAND['insert_breakpoint'],
-                address=address, breakpoint_type=type)
-        return Command().unpack(self._client.hbootdbg(cmd.pack()))
+                address=address, breakpoint_type=type, conditions=conditions)
+        return self._execute(cmd)
+
+    def set_trace_actions(self, address, actions):
+        ''' Set what the tracepoint at address, inserted as a BREAKPOINT_TRACE
+        breakpoint, collects. actions are built by trace_registers,
+        trace_memory and trace_expression. '''
+        cmd = Command(COMMAND['trace_actions'],
+                address=address, actions=b''.join(actions))
+        return self._execute(cmd)
+
+    def trace_start(self):
+        ''' Tracepoints collect frames from now on, and never stop the target.
+        Frames of the previous run are discarded. '''
+        return self._execute(Command(COMMAND['trace_start']))
+
+    def trace_stop(self):
+        return self._execute(Command(COMMAND['trace_stop']))
+
+    def trace_dump(self):
+        ''' Drain the frames collected by tracepoints, they are in the frames
+        attribute '''
+        return self._execute(Command(COMMAND['trace_dump']))
 
     def remove_breakpoint(self, address, type=BREAKPOINT_NORMAL):
         cmd = Command(COMMAND['remove_breakpoint'],
                 address=address, breakpoint_type=type)
-        return Command().unpack(self._client.hbootdbg(cmd.pack()))
+        return self._execute(cmd)
+
+    def insert_breakpoints(self, addresses, type=BREAKPOINT_NORMAL):
+        ''' Insert up to BREAKPOINTS_MAX breakpoints without condition in one
+        round trip, the caches being synchronized once for all of them.
+        Whether each address got one is in the done attribute, already
+        inserted breakpoints of the same type count. '''
+        cmd = Command(COMMAND['insert_breakpoints'],
+                addresses=tuple(addresses), breakpoint_type=type)
+        return self._execute(cmd)
+
+    def remove_breakpoints(self, addresses, type=BREAKPOINT_NORMAL):
+        ''' Remove up to BREAKPOINTS_MAX breakpoints in one round trip, see
+        insert_breakpoints '''
+        cmd = Command(COMMAND['remove_breakpoints'],
+                addresses=tuple(addresses), breakpoint_type=type)
+        return self._execute(cmd)
+
+    def update_breakpoints(self, func, addresses, type=BREAKPOINT_NORMAL):
+        ''' Insert or remove any number of breakpoints, func being
+        insert_breakpoints or remove_breakpoints, in as few round trips as
+        possible. Returns the addresses done. The results are read back, this
+        can't be queued in an enclosing batch. '''
+        results = []
+        with self.batch():
+            for i in range(0, len(addresses), BREAKPOINTS_MAX):
+                chunk = addresses[i:i + BREAKPOINTS_MAX]
+                results.append((chunk, func(chunk, type)))
+        return [a for chunk, res in results
+                if res.error == ERROR_SUCCESS
+                for a, done in zip(chunk, res.done) if done]
+
+    def coverage(self, address, size):
+        ''' Start recording which instructions of [address, address + size)
+        BREAKPOINT_COVERAGE breakpoints are hit at. These are removed by the
+        debugger once hit, without stopping. The bitmap, a bit per instruction
+        from the least significant bit of its first byte, lies at the address
+        in the bitmap attribute, to be read back with read(). '''
+        cmd = Command(COMMAND['coverage'], address=address, size=size)
+        return self._execute(cmd)
+
+    def profile_start(self):
+        ''' Count the calls of the functions BREAKPOINT_PROFILE breakpoints are
+        inserted at and time them with the cycle counter, without stopping.
+        Counters are reset. '''
+        return self._execute(Command(COMMAND['profile_start']))
+
+    def profile_stop(self):
+        return self._execute(Command(COMMAND['profile_stop']))
+
+    def profile_dump(self):
+        ''' Counters of the profiled functions, as (address, calls, cycles)
+        tuples in the functions attribute '''
+        return self._execute(Command(COMMAND['profile_dump']))
+
+    def ignore_count(self, address, count):
+        ''' Resume without stopping from the next count hits of the breakpoint
+        at address, hits with a false condition not counting '''
+        cmd = Command(COMMAND['ignore_count'], address=address, count=count)
+        return self._execute(cmd)
+
+    def breakpoint_counters(self, reset=False):
+        ''' Counters of every breakpoint, as (address, type, hits,
+        ignore_count) tuples in the counters attribute. Hits are zeroed
+        afterwards if reset is set. '''
+        cmd = Command(COMMAND['breakpoint_counters'], reset=reset)
+        return self._execute(cmd)
 
     def breakpoint_continue(self):
+        # Any pending event predates this command
+        self._client.clear_events()
         cmd = Command(COMMAND['breakpoint_continue'])
-        return Command().unpack(self._client.hbootdbg(cmd.pack()))
+        return self._execute(cmd)
+
+    def step(self, start=0, end=0):
+        ''' Execute a single instruction, following branches, or as many as
+        needed for pc to leave [start, end). As for breakpoint_continue, the
+        stop is to be waited for with wait_stop. '''
+        self._client.clear_events()
+        cmd = Command(COMMAND['step'], start=start, end=end)
+        return self._execute(cmd)
+
+    def wait_stop(self, timeout=None):
+        ''' Block until the debugger reports that the target stopped. Returns a
+        Command holding event, pc and cpsr, its error is ERROR_TIMEOUT if
+        nothing happened in time. '''
+        return Command().unpack(self._client.wait_event(timeout))
 
     def get_registers(self):
         cmd = Command(COMMAND['get_registers'])
-        return Command().unpack(self._client.hbootdbg(cmd.pack()))
+        return self._execute(cmd)
+
+    def set_registers(self, registers):
+        ''' Write registers of the stopped context, given as a dict from
+        register index (see REGISTER_CPSR) to value '''
+        cmd = Command(COMMAND['set_registers'], registers=registers)
+        return self._execute(cmd)
 
     def call(self, address, args = (0, 0, 0, 0)):
         cmd = Command(COMMAND['call'],
                 address=address,
                 args=args)
-        return Command().unpack(self._client.hbootdbg(cmd.pack()))
+        return self._execute(cmd)
 
     def breakpoint(self):
         cmd = Command(COMMAND['breakpoint'])
-        return Command().unpack(self._client.hbootdbg(cmd.pack()))
+        return self._execute(cmd)
 
     def flashlight(self, time_):
         cmd = Command(COMMAND['flashlight'], time_)
-        return Command().unpack(self._client.hbootdbg(cmd.pack()))
+        return self._execute(cmd)
 
     def fastboot_reboot(self):
         cmd = Command(COMMAND['fastboot_reboot'])
-        return Command().unpack(self._client.hbootdbg(cmd.pack()))
+        return self._execute(cmd)
 
     def raw(self, data):
-        return self._client.hbootdbg(data.to_bytes(4, sys.byteorder))
+        data = data.to_bytes(4, sys.byteorder)
+        return self._client.hbootdbg(data, struct.unpack_from('H', data, 2)[0])
 
     def console(self):
         while True:
@@ -0,0 +1,226 @@
+#! /usr/bin/env python3
+
+# This file is part of hbootdbg.
+# Copyright (c) 2013, Cedric Halbronn <cedric.halbronn@sogeti.com>
+# Copyright (c) 2013, Nicolas Hureau <nicolas.hureau@sogeti.com>
+# All right reserved.
+#
+# Redistribution and use in source and binary forms, with or without modification,
+# are permitted provided that the following conditions are met:
+# 
+# * Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+# 
+# * Redistributions in binary form must reproduce the above copyright notice, this
+#   list of conditions and the following disclaimer in the documentation and/or
+#   other materials provided with the distribution.
+# 
+# * Neither the name of the {organization} nor the names of its
+#   contributors may be used to endorse or promote products derived from
+#   this software without specific prior written permission.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+import binascii
+import struct
+import hbootdbg
+from hboot import RESPONSE_HEADER, RESPONSE_MORE
+
+##
+# Simulated device
+##
+
+# Debugger constants, see src/hbootdbg/dbg.h
+CMD_READ                        = 3
+CMD_WRITE                       = 4
+CMD_BATCH                       = 11
+CMD_READ_RLE                    = 12
+CMD_CHECKSUM                    = 15
+
+ERROR_SUCCESS                   = 0
+ERROR_UNKNOWN_CMD               = 1
+ERROR_UNMAPPED_MEMORY           = 7
+
+RESPONSE_MAGIC                  = 0xdb9d
+RLE_BLOCK_SIZE                  = 256
+RLE_MAX_SIZE                    = RLE_BLOCK_SIZE + RLE_BLOCK_SIZE // 128 + 1
+USB_BLOCK_SIZE                  = 1024
+
+def rle_compress(data):
+    ''' Same encoding as rle_compress() in src/hbootdbg/rle.c '''
+    out = bytearray()
+    literal = 0
+    i = 0
+
+    def flush(start, end):
+        for j in range(start, end, 128):
+            chunk = data[j:min(j + 128, end)]
+            out.append(len(chunk) - 1)
+            out.extend(chunk)
+
+    while i + 8 <= len(data):
+        word = data[i:i + 4]
+        run = 1
+        while run < 129 and i + (run + 1) * 4 <= len(data) and \
+                data[i + run * 4:i + run * 4 + 4] == word:
+            run += 1
+        if run < 2:
+            i += 1
+            continue
+        flush(literal, i)
+        out.append(0x80 | (run - 2))
+        out.extend(word)
+        i += run * 4
+        literal = i
+
+    flush(literal, len(data))
+    return bytes(out)
+
+class SimulatedDevice:
+    ''' Serial-like object emulating the debugger stopped on a breakpoint.
+
+    Nothing is slept: the time the USB link would have spent is accounted in
+    link_time, given a bandwidth (bytes/s) and a latency paid per transfer. '''
+
+    def __init__(self, bandwidth=1000000, latency=0.000125):
+        self.bandwidth = bandwidth
+        self.latency = latency
+        self.link_time = 0.0
+        self.transfers = 0
+        self.link_bytes = 0
+        self._regions = []
+        self._out = bytearray()
+        self._handlers = {
+            CMD_READ        : self._cmd_read,
+            CMD_WRITE       : self._cmd_write,
+            CMD_READ_RLE    : self._cmd_read_rle,
+            CMD_CHECKSUM    : self._cmd_checksum,
+            CMD_BATCH       : self._cmd_batch,
+        }
+
+    def map(self, address, data):
+        self._regions.append((address, bytearray(data)))
+
+    def memory(self, address, size):
+        for base, data in self._regions:
+            if base <= address and address + size <= base + len(data):
+                return memoryview(data)[address - base:address - base + size]
+        return None
+
+    # Serial interface
+
+    def write(self, data):
+        self._account(len(data))
+        data = data.split(b' ', 1)[1]
+        self._dispatch(binascii.a2b_base64(data.strip()))
+
+    def read(self, size):
+        data = bytes(self._out[:size])
+        del self._out[:size]
+        return data
+
+    def inWaiting(self):
+        return len(self._out)
+
+    def close(self):
+        pass
+
+    # Device side
+
+    def _account(self, size):
+        self.transfers += 1
+        self.link_bytes += size
+        self.link_time += self.latency + size / self.bandwidth
+
+    def _dispatch(self, cmd):
+        ''' Run a command, returns its error code '''
+        (type, _, seq) = struct.unpack_from('<BBH', cmd)
+        handler = self._handlers.get(type)
+        if handler is None:
+            self._reply(type, seq, ERROR_UNKNOWN_CMD)
+            return ERROR_UNKNOWN_CMD
+        return handler(type, seq, cmd[4:])
+
+    def _usb_send(self, data):
+        self._account(len(data))
+        self._out += data
+
+    def _header(self, type, seq, error, size, more=False):
+        return RESPONSE_HEADER.pack(RESPONSE_MAGIC, seq, type, error,
+            RESPONSE_MORE if more else 0, size)
+
+    def _reply(self, type, seq, error, payload=b''):
+        self._usb_send(self._header(type, seq, error, len(payload)))
+        for i in range(0, len(payload), USB_BLOCK_SIZE):
+            self._usb_send(payload[i:i + USB_BLOCK_SIZE])
+
+    def _cmd_read(self, type, seq, args):
+        (address, size) = struct.unpack_from('<II', args)
+        data = self.memory(address, size)
+        if data is None:
+            self._reply(type, seq, ERROR_UNMAPPED_MEMORY)
+            return ERROR_UNMAPPED_MEMORY
+        self._reply(type, seq, ERROR_SUCCESS, bytes(data))
+        return ERROR_SUCCESS
+
+    def _cmd_read_rle(self, type, seq, args):
+        (address, size) = struct.unpack_from('<II', args)
+        data = self.memory(address, size)
+        if data is None:
+            self._reply(type, seq, ERROR_UNMAPPED_MEMORY)
+            return ERROR_UNMAPPED_MEMORY
+        # Compressed blocks are packed in parts of at most USB_BLOCK_SIZE bytes,
+        # sent along with their header
+        part = b''
+        for offset in range(0, max(size, 1), RLE_BLOCK_SIZE):
+            part += rle_compress(bytes(data[offset:offset + RLE_BLOCK_SIZE]))
+            last = offset + RLE_BLOCK_SIZE >= size
+            if last or len(part) + RLE_MAX_SIZE > USB_BLOCK_SIZE:
+                self._usb_send(self._header(type, seq, ERROR_SUCCESS,
+                    len(part), more=not last) + part)
+                part = b''
+        return ERROR_SUCCESS
+
+    def _cmd_write(self, type, seq, args):
+        (address, size) = struct.unpack_from('<II', args)
+        data = self.memory(address, size)
+        if data is None:
+            self._reply(type, seq, ERROR_UNMAPPED_MEMORY)
+            return ERROR_UNMAPPED_MEMORY
+        data[:] = args[8:8 + size]
+        self._reply(type, seq, ERROR_SUCCESS)
+        return ERROR_SUCCESS
+
+    def _cmd_checksum(self, type, seq, args):
+        (address, size, block_size) = struct.unpack_from('<III', args)
+        data = self.memory(address, size)
+        if data is None:
+            self._reply(type, seq, ERROR_UNMAPPED_MEMORY)
+            return ERROR_UNMAPPED_MEMORY
+        if block_size == 0 or block_size > size:
+            block_size = size
+        crcs = b''.join(
+            struct.pack('<I', hbootdbg.crc32(data[i:i + block_size]))
+            for i in range(0, max(size, 1), max(block_size, 1)))
+        self._reply(type, seq, ERROR_SUCCESS, crcs)
+        return ERROR_SUCCESS
+
+    def _cmd_batch(self, type, seq, args):
+        (count, size) = struct.unpack_from('<II', args)
+        errors = bytearray()
+        offset = 8
+        for _ in range(count):
+            entry_size = struct.unpack_from('<I', args, offset)[0]
+            errors.append(self._dispatch(args[offset + 4:offset + 4 + entry_size]))
+            offset += 4 + (entry_size + 3) // 4 * 4
+        self._reply(type, seq, ERROR_SUCCESS, bytes(errors))
+        return ERROR_SUCCESS
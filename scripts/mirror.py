@@ -0,0 +1,133 @@
+#! /usr/bin/env python3
+
+# This file is part of hbootdbg.
+# Copyright (c) 2013, Cedric Halbronn <cedric.halbronn@sogeti.com>
+# Copyright (c) 2013, Nicolas Hureau <nicolas.hureau@sogeti.com>
+# All right reserved.
+#
+# Redistribution and use in source and binary forms, with or without modification,
+# are permitted provided that the following conditions are met:
+# 
+# * Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+# 
+# * Redistributions in binary form must reproduce the above copyright notice, this
+#   list of conditions and the following disclaimer in the documentation and/or
+#   other materials provided with the distribution.
+# 
+# * Neither the name of the {organization} nor the names of its
+#   contributors may be used to endorse or promote products derived from
+#   this software without specific prior written permission.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+import collections
+import mmap
+import tempfile
+import hbootdbg
+
+# Granularity of the checksums, smaller blocks mean less data read back for
+# scattered changes but longer checksum replies
+MIRROR_BLOCK_SIZE               = 1024
+
+Region = collections.namedtuple('Region', 'address size offset')
+
+class TargetMemoryMirror:
+    ''' Local copy of regions of the target memory, kept up to date with the
+    per-block checksums computed by the debugger: sync() only reads back the
+    blocks whose CRC changed since the previous call.
+
+    The copy lives in a memory-mapped file (an anonymous temporary file unless
+    path is given), so large mirrors stay out of the Python heap. '''
+
+    def __init__(self, dbg, block_size=MIRROR_BLOCK_SIZE, path=None):
+        self._dbg = dbg
+        self._block_size = block_size
+        self._file = open(path, 'w+b') if path else tempfile.TemporaryFile()
+        self._map = None
+        self._size = 0
+        self._regions = []
+        self._crcs = []
+        # Bytes read back by the last sync()
+        self.fetched = 0
+
+    def add_region(self, address, size):
+        ''' Mirror [address, address + size), fetched by the next sync() '''
+        region = Region(address, size, self._size)
+        self._size += size
+        self._file.truncate(self._size)
+        if self._map is not None:
+            self._map.close()
+        self._map = mmap.mmap(self._file.fileno(), self._size)
+        self._regions.append(region)
+        self._crcs.append(None)
+        return region
+
+    def sync(self):
+        ''' Bring the mirror up to date, to be called every time the target
+        stops. Returns the number of bytes read back. '''
+        with self._dbg.batch():
+            sums = [self._dbg.checksum(r.address, r.size, self._block_size)
+                    for r in self._regions]
+
+        reads = []
+        with self._dbg.batch():
+            for i, (region, res) in enumerate(zip(self._regions, sums)):
+                if res.error != hbootdbg.ERROR_SUCCESS:
+                    # Fetch everything again once the region is readable
+                    self._crcs[i] = None
+                    continue
+                changed = [b for b, crc in enumerate(res.crcs)
+                           if self._crcs[i] is None or self._crcs[i][b] != crc]
+                for first, count in self._runs(changed):
+                    offset = first * self._block_size
+                    size = min(count * self._block_size, region.size - offset)
+                    read = self._dbg.read(region.address + offset, size,
+                                          compressed=True)
+                    reads.append((i, region.offset + offset, size, read))
+                self._crcs[i] = res.crcs
+
+        self.fetched = 0
+        for i, offset, size, read in reads:
+            if read.error != hbootdbg.ERROR_SUCCESS or len(read.data) != size:
+                self._crcs[i] = None
+                continue
+            self._map[offset:offset + size] = read.data
+            self.fetched += size
+        return self.fetched
+
+    def read(self, address, size):
+        ''' Read from the mirror, the range must lie within a single region '''
+        for region in self._regions:
+            offset = address - region.address
+            if 0 <= offset and offset + size <= region.size:
+                offset += region.offset
+                return self._map[offset:offset + size]
+        raise ValueError('{:08x}-{:08x} is not mirrored'.format(
+            address, address + size))
+
+    def close(self):
+        if self._map is not None:
+            self._map.close()
+        self._file.close()
+
+    @staticmethod
+    def _runs(blocks):
+        ''' Group sorted block indexes in (first, count) runs of contiguous
+        blocks, so that each run is fetched with a single read '''
+        runs = []
+        for b in blocks:
+            if runs and runs[-1][0] + runs[-1][1] == b:
+                runs[-1][1] += 1
+            else:
+                runs.append([b, 1])
+        return runs
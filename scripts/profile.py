@@ -0,0 +1,104 @@
+#! /usr/bin/env python3
+
+# This file is part of hbootdbg.
+# Copyright (c) 2013, Cedric Halbronn <cedric.halbronn@sogeti.com>
+# Copyright (c) 2013, Nicolas Hureau <nicolas.hureau@sogeti.com>
+# All right reserved.
+#
+# Redistribution and use in source and binary forms, with or without modification,
+# are permitted provided that the following conditions are met:
+# 
+# * Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+# 
+# * Redistributions in binary form must reproduce the above copyright notice, this
+#   list of conditions and the following disclaimer in the documentation and/or
+#   other materials provided with the distribution.
+# 
+# * Neither the name of the {organization} nor the names of its
+#   contributors may be used to endorse or promote products derived from
+#   this software without specific prior written permission.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+''' Call counts and cycles spent in functions, timed by the debugger with the
+cycle counter of the performance monitors. A breakpoint at the entry of each
+function counts the call and makes it return through a breakpoint of the
+debugger, which stops its timer. None of them involves the host.
+
+Cycles of a function include the ones of the functions it calls, and of the
+debugger handling the breakpoints in between.
+'''
+
+import argparse
+import time
+import hbootdbg
+
+def read_addresses(f):
+    ''' Function addresses of a file, one per line, anything after the
+    address being ignored '''
+    addresses = []
+    for line in f:
+        line = line.split('#')[0].split()
+        if line:
+            addresses.append(int(line[0], 0))
+    return addresses
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument('address', type=lambda x: int(x, 0), nargs='*',
+            help='entry point of a function')
+    parser.add_argument('-f', '--fastboot-mode', action='store_true')
+    parser.add_argument('-l', '--list', type=argparse.FileType('r'),
+            help='file of function addresses, one per line')
+    parser.add_argument('-t', '--time', type=float,
+            help='seconds to profile for, instead of until enter is pressed')
+    args = parser.parse_args()
+
+    addresses = list(args.address)
+    if args.list:
+        addresses += read_addresses(args.list)
+    if not addresses:
+        parser.error('no function to profile')
+
+    dbg = hbootdbg.HbootDbg(fastboot_mode=args.fastboot_mode)
+
+    inserted = dbg.update_breakpoints(dbg.insert_breakpoints, addresses,
+                                      hbootdbg.BREAKPOINT_PROFILE)
+    print('{} of {} functions profiled'.format(len(inserted),
+                                               len(addresses)))
+
+    res = dbg.profile_start()
+    if res.error != hbootdbg.ERROR_SUCCESS:
+        dbg.update_breakpoints(dbg.remove_breakpoints, inserted,
+                               hbootdbg.BREAKPOINT_PROFILE)
+        hbootdbg.exit_on_error('Starting profiling failed', res)
+
+    if args.time is not None:
+        time.sleep(args.time)
+    else:
+        input('Profiling, press enter to stop')
+
+    dbg.profile_stop()
+    res = dbg.profile_dump()
+    dbg.update_breakpoints(dbg.remove_breakpoints, inserted,
+                           hbootdbg.BREAKPOINT_PROFILE)
+    hbootdbg.exit_on_error('Reading the counters failed', res)
+
+    print('{:>10}  {:>10}  {:>16}  {:>12}'.format('address', 'calls', 'cycles',
+                                                  'cycles/call'))
+    for address, calls, cycles in sorted(res.functions, key=lambda f: f[2],
+                                         reverse=True):
+        if address not in inserted:
+            continue
+        print('0x{:08x}  {:>10}  {:>16}  {:>12}'.format(
+            address, calls, cycles, cycles // calls if calls else 0))
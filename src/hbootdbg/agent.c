@@ -0,0 +1,408 @@
+/*
+** This file is part of hbootdbg.
+** Copyright (C) 2013 Cedric Halbronn <cedric.halbronn@sogeti.com>
+** Copyright (C) 2013 Nicolas Hureau <nicolas.hureau@sogeti.com>
+** All rights reserved.
+**
+** Code greatly inspired by qcombbdbg.
+** Copyright (C) 2012 Guillaume Delugré <guillaume@security-labs.org>
+**
+** Redistribution and use in source and binary forms, with or without modification,
+** are permitted provided that the following conditions are met:
+**
+** * Redistributions of source code must retain the above copyright notice, this
+**   list of conditions and the following disclaimer.
+**
+** * Redistributions in binary form must reproduce the above copyright notice, this
+**   list of conditions and the following disclaimer in the documentation and/or
+**   other materials provided with the distribution.
+**
+** * Neither the name of the {organization} nor the names of its
+**   contributors may be used to endorse or promote products derived from
+**   this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+** WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+** ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+** (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+** LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+** ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+** SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "agent.h"
+
+#include "mmu.h"
+
+/*
+** Bytecodes, see "Agent Expressions" in the GDB manual. Floating point, trace
+** state variables and printf are not supported.
+*/
+#define OP_ADD                  0x02
+#define OP_SUB                  0x03
+#define OP_MUL                  0x04
+#define OP_DIV_SIGNED           0x05
+#define OP_DIV_UNSIGNED         0x06
+#define OP_REM_SIGNED           0x07
+#define OP_REM_UNSIGNED         0x08
+#define OP_LSH                  0x09
+#define OP_RSH_SIGNED           0x0a
+#define OP_RSH_UNSIGNED         0x0b
+#define OP_TRACE                0x0c
+#define OP_TRACE_QUICK          0x0d
+#define OP_LOG_NOT              0x0e
+#define OP_BIT_AND              0x0f
+#define OP_BIT_OR               0x10
+#define OP_BIT_XOR              0x11
+#define OP_BIT_NOT              0x12
+#define OP_EQUAL                0x13
+#define OP_LESS_SIGNED          0x14
+#define OP_LESS_UNSIGNED        0x15
+#define OP_EXT                  0x16
+#define OP_REF8                 0x17
+#define OP_REF16                0x18
+#define OP_REF32                0x19
+#define OP_IF_GOTO              0x20
+#define OP_GOTO                 0x21
+#define OP_CONST8               0x22
+#define OP_CONST16              0x23
+#define OP_CONST32              0x24
+#define OP_REG                  0x26
+#define OP_END                  0x27
+#define OP_DUP                  0x28
+#define OP_POP                  0x29
+#define OP_ZERO_EXT             0x2a
+#define OP_SWAP                 0x2b
+#define OP_TRACENZ              0x2f
+#define OP_TRACE16              0x30
+#define OP_PICK                 0x32
+#define OP_ROT                  0x33
+
+// GDB numbering of cpsr, r0-r15 being 0-15
+#define AGENT_REG_CPSR          25
+
+/*
+** Unsigned division, there is no divide instruction nor libgcc to rely on.
+*/
+static
+u32 udivmod(u32 n, u32 d, u32* rem)
+{
+    u32 q = 0;
+    u32 r = 0;
+
+    for (int i = 31; i >= 0; --i)
+    {
+        r = (r << 1) | ((n >> i) & 1);
+        if (r >= d)
+        {
+            r -= d;
+            q |= 1 << i;
+        }
+    }
+
+    *rem = r;
+    return q;
+}
+
+static
+agent_error divide(u8 op, u32 a, u32 b, u32* result)
+{
+    int negative_q = 0;
+    int negative_r = 0;
+    u32 q;
+    u32 r;
+
+    if (b == 0)
+        return AGENT_DIVIDE_BY_ZERO;
+
+    if (op == OP_DIV_SIGNED || op == OP_REM_SIGNED)
+    {
+        negative_q = ((s32) a < 0) != ((s32) b < 0);
+        negative_r = (s32) a < 0;
+        a = (s32) a < 0 ? -a : a;
+        b = (s32) b < 0 ? -b : b;
+    }
+
+    q = udivmod(a, b, &r);
+
+    if (op == OP_DIV_SIGNED || op == OP_DIV_UNSIGNED)
+        *result = negative_q ? -q : q;
+    else
+        *result = negative_r ? -r : r;
+
+    return AGENT_SUCCESS;
+}
+
+/*
+** Little endian read of "size" bytes, byte by byte as it may be unaligned.
+*/
+static
+agent_error ref(u32 addr, uint size, u32* value)
+{
+    const u8* p = (const u8*) addr;
+
+    if (!mmu_probe_read((void*) addr, size))
+        return AGENT_MEMORY_FAULT;
+
+    *value = 0;
+    for (uint i = 0; i < size; ++i)
+        *value |= p[i] << (8 * i);
+
+    return AGENT_SUCCESS;
+}
+
+/*
+** Length of the string at "addr" including its terminating zero, or "size" if
+** there is none before.
+*/
+static
+u32 string_size(u32 addr, u32 size)
+{
+    const u8* p = (const u8*) addr;
+    u32 len = 0;
+
+    while (len < size && mmu_probe_read((void*) (p + len), 1))
+        if (p[len++] == 0)
+            break;
+
+    return len;
+}
+
+/*
+** Evaluate an expression against the registers of the stopped context, the
+** value left on top of the stack by "end" (0 if it is empty) is stored in
+** "result".
+*/
+agent_error agent_eval(const u8* code, uint size, const context* ctx,
+                       agent_collect collect, u32* result)
+{
+    u32 stack[AGENT_STACK_SIZE];
+    uint sp = 0;
+    uint pc = 0;
+    uint steps = 0;
+    uint operand_size;
+    u32 operand;
+    u32 a;
+    u32 b;
+    u8 op;
+    agent_error error;
+
+// Operands popped or pushed by an instruction
+#define NEED(n)     if (sp < (n)) return AGENT_BAD_STACK
+#define ROOM(n)     if (sp + (n) > AGENT_STACK_SIZE) return AGENT_BAD_STACK
+
+    while (pc < size)
+    {
+        if (++steps > AGENT_MAX_STEPS)
+            return AGENT_TOO_LONG;
+
+        op = code[pc++];
+
+        // Immediate operands are big endian
+        switch (op)
+        {
+        case OP_EXT:
+        case OP_ZERO_EXT:
+        case OP_PICK:
+        case OP_CONST8:
+        case OP_TRACE_QUICK:
+            operand_size = 1;
+            break;
+        case OP_IF_GOTO:
+        case OP_GOTO:
+        case OP_CONST16:
+        case OP_REG:
+        case OP_TRACE16:
+            operand_size = 2;
+            break;
+        case OP_CONST32:
+            operand_size = 4;
+            break;
+        default:
+            operand_size = 0;
+            break;
+        }
+
+        if (operand_size > size - pc)
+            return AGENT_BAD_OPCODE;
+
+        operand = 0;
+        for (uint i = 0; i < operand_size; ++i)
+            operand = (operand << 8) | code[pc++];
+
+        switch (op)
+        {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV_SIGNED:
+        case OP_DIV_UNSIGNED:
+        case OP_REM_SIGNED:
+        case OP_REM_UNSIGNED:
+        case OP_LSH:
+        case OP_RSH_SIGNED:
+        case OP_RSH_UNSIGNED:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_EQUAL:
+        case OP_LESS_SIGNED:
+        case OP_LESS_UNSIGNED:
+            NEED(2);
+            b = stack[--sp];
+            a = stack[sp - 1];
+
+            switch (op)
+            {
+            case OP_ADD:            a = a + b; break;
+            case OP_SUB:            a = a - b; break;
+            case OP_MUL:            a = a * b; break;
+            case OP_LSH:            a = b < 32 ? a << b : 0; break;
+            case OP_RSH_SIGNED:     a = (s32) a >> (b < 32 ? b : 31); break;
+            case OP_RSH_UNSIGNED:   a = b < 32 ? a >> b : 0; break;
+            case OP_BIT_AND:        a = a & b; break;
+            case OP_BIT_OR:         a = a | b; break;
+            case OP_BIT_XOR:        a = a ^ b; break;
+            case OP_EQUAL:          a = a == b; break;
+            case OP_LESS_SIGNED:    a = (s32) a < (s32) b; break;
+            case OP_LESS_UNSIGNED:  a = a < b; break;
+            default:
+                error = divide(op, a, b, &a);
+                if (error != AGENT_SUCCESS)
+                    return error;
+                break;
+            }
+
+            stack[sp - 1] = a;
+            break;
+
+        case OP_LOG_NOT:
+            NEED(1);
+            stack[sp - 1] = !stack[sp - 1];
+            break;
+
+        case OP_BIT_NOT:
+            NEED(1);
+            stack[sp - 1] = ~stack[sp - 1];
+            break;
+
+        case OP_EXT:
+            NEED(1);
+            if (operand > 0 && operand < 32)
+                stack[sp - 1] = (s32) (stack[sp - 1] << (32 - operand))
+                                >> (32 - operand);
+            break;
+
+        case OP_ZERO_EXT:
+            NEED(1);
+            if (operand < 32)
+                stack[sp - 1] &= (1u << operand) - 1;
+            break;
+
+        case OP_REF8:
+        case OP_REF16:
+        case OP_REF32:
+            NEED(1);
+            error = ref(stack[sp - 1], 1 << (op - OP_REF8), &stack[sp - 1]);
+            if (error != AGENT_SUCCESS)
+                return error;
+            break;
+
+        case OP_IF_GOTO:
+            NEED(1);
+            if (stack[--sp] == 0)
+                break;
+            // Fall through
+        case OP_GOTO:
+            if (operand >= size)
+                return AGENT_BAD_JUMP;
+            pc = operand;
+            break;
+
+        case OP_CONST8:
+        case OP_CONST16:
+        case OP_CONST32:
+            ROOM(1);
+            stack[sp++] = operand;
+            break;
+
+        case OP_REG:
+            ROOM(1);
+            if (operand < 16)
+                stack[sp++] = ctx->r[operand];
+            else if (operand == AGENT_REG_CPSR)
+                stack[sp++] = ctx->cpsr;
+            else
+                return AGENT_BAD_OPCODE;
+            break;
+
+        case OP_TRACE:
+        case OP_TRACENZ:
+            NEED(2);
+            if (collect == NULL)
+                return AGENT_BAD_OPCODE;
+            b = stack[--sp];
+            a = stack[--sp];
+            collect(a, op == OP_TRACENZ ? string_size(a, b) : b);
+            break;
+
+        case OP_TRACE_QUICK:
+        case OP_TRACE16:
+            NEED(1);
+            if (collect == NULL)
+                return AGENT_BAD_OPCODE;
+            collect(stack[sp - 1], operand);
+            break;
+
+        case OP_END:
+            *result = sp > 0 ? stack[sp - 1] : 0;
+            return AGENT_SUCCESS;
+
+        case OP_DUP:
+            NEED(1);
+            ROOM(1);
+            stack[sp] = stack[sp - 1];
+            sp++;
+            break;
+
+        case OP_POP:
+            NEED(1);
+            sp--;
+            break;
+
+        case OP_SWAP:
+            NEED(2);
+            a = stack[sp - 1];
+            stack[sp - 1] = stack[sp - 2];
+            stack[sp - 2] = a;
+            break;
+
+        case OP_PICK:
+            NEED(operand + 1);
+            ROOM(1);
+            stack[sp] = stack[sp - 1 - operand];
+            sp++;
+            break;
+
+        case OP_ROT:
+            NEED(3);
+            a = stack[sp - 1];
+            stack[sp - 1] = stack[sp - 2];
+            stack[sp - 2] = stack[sp - 3];
+            stack[sp - 3] = a;
+            break;
+
+        default:
+            return AGENT_BAD_OPCODE;
+        }
+    }
+
+#undef NEED
+#undef ROOM
+
+    // Ran off the end without "end"
+    return AGENT_BAD_OPCODE;
+}
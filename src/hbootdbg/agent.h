@@ -0,0 +1,68 @@
+/*
+** This file is part of hbootdbg.
+** Copyright (C) 2013 Cedric Halbronn <cedric.halbronn@sogeti.com>
+** Copyright (C) 2013 Nicolas Hureau <nicolas.hureau@sogeti.com>
+** All rights reserved.
+**
+** Code greatly inspired by qcombbdbg.
+** Copyright (C) 2012 Guillaume Delugré <guillaume@security-labs.org>
+**
+** Redistribution and use in source and binary forms, with or without modification,
+** are permitted provided that the following conditions are met:
+**
+** * Redistributions of source code must retain the above copyright notice, this
+**   list of conditions and the following disclaimer.
+**
+** * Redistributions in binary form must reproduce the above copyright notice, this
+**   list of conditions and the following disclaimer in the documentation and/or
+**   other materials provided with the distribution.
+**
+** * Neither the name of the {organization} nor the names of its
+**   contributors may be used to endorse or promote products derived from
+**   this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+** WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+** ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+** (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+** LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+** ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+** SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __AGENT_H__
+# define __AGENT_H__
+
+# include "cpu.h"
+
+# define AGENT_STACK_SIZE       32
+// Bytecodes executed by a single evaluation, bounds loops built with goto
+# define AGENT_MAX_STEPS        4096
+
+/*
+** GDB agent expression evaluation, values are 32 bits wide.
+*/
+typedef enum
+{
+    AGENT_SUCCESS               = 0,
+    AGENT_BAD_OPCODE            = 1,    // Unknown or unsupported
+    AGENT_BAD_STACK             = 2,    // Stack underflow or overflow
+    AGENT_BAD_JUMP              = 3,
+    AGENT_MEMORY_FAULT          = 4,
+    AGENT_DIVIDE_BY_ZERO        = 5,
+    AGENT_TOO_LONG              = 6,
+} agent_error;
+
+/*
+** Called by the trace bytecodes to record memory, these are rejected if it is
+** NULL.
+*/
+typedef void (*agent_collect)(u32 addr, u32 size);
+
+agent_error agent_eval(const u8* code, uint size, const context* ctx,
+                       agent_collect collect, u32* result);
+
+#endif // __AGENT_H__
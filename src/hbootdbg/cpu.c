@@ -87,3 +87,34 @@ u32 cpu_get_branch(u32 from, u32 to)
 {
     return 0xea000000 | (((to - from - 8) >> 2) & 0x00ffffff);
 }
+
+void cpu_enable_cycle_counter(void)
+{
+    u32 pmcr;
+
+    ASM(
+        "mrc p15, 0, %0, c9, c12, 0\n"
+        : "=r" (pmcr)
+    );
+
+    // Enable the counters (E), counting every cycle rather than every 64 (D)
+    pmcr = (pmcr | (1 << 0)) & ~(1 << 3);
+
+    ASM(
+        "mcr p15, 0, %0, c9, c12, 0\n"
+        "mcr p15, 0, %1, c9, c12, 1\n"
+        :: "r" (pmcr), "r" (1 << 31)
+    );
+}
+
+u32 cpu_get_cycle_counter(void)
+{
+    u32 cycles;
+
+    ASM(
+        "mrc p15, 0, %0, c9, c13, 0\n"
+        : "=r" (cycles)
+    );
+
+    return cycles;
+}
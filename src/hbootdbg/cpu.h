@@ -101,4 +101,11 @@ void cpu_put_cpsr(u32 cpsr);
 
 u32 cpu_get_branch(u32 from, u32 to);
 
+/*
+** Cycle counter of the performance monitors (PMCCNTR)
+*/
+
+void cpu_enable_cycle_counter(void);
+u32 cpu_get_cycle_counter(void);
+
 #endif // __CPU_H__
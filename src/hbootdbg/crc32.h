@@ -0,0 +1,49 @@
+/*
+** This file is part of hbootdbg.
+** Copyright (C) 2013 Cedric Halbronn <cedric.halbronn@sogeti.com>
+** Copyright (C) 2013 Nicolas Hureau <nicolas.hureau@sogeti.com>
+** All rights reserved.
+**
+** Code greatly inspired by qcombbdbg.
+** Copyright (C) 2012 Guillaume Delugré <guillaume@security-labs.org>
+**
+** Redistribution and use in source and binary forms, with or without modification,
+** are permitted provided that the following conditions are met:
+**
+** * Redistributions of source code must retain the above copyright notice, this
+**   list of conditions and the following disclaimer.
+**
+** * Redistributions in binary form must reproduce the above copyright notice, this
+**   list of conditions and the following disclaimer in the documentation and/or
+**   other materials provided with the distribution.
+**
+** * Neither the name of the {organization} nor the names of its
+**   contributors may be used to endorse or promote products derived from
+**   this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+** WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+** ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+** (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+** LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+** ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+** SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __CRC32_H__
+# define __CRC32_H__
+
+/*
+** CRC-32 as computed by GDB (libiberty's xcrc32): polynomial 0x04c11db7, most
+** significant bit first, no final inversion. GDB uses 0xffffffff as initial
+** value for qCRC.
+*/
+
+# define CRC32_INIT             0xffffffff
+
+u32 crc32(u32 crc, const u8* buf, uint size);
+
+#endif // __CRC32_H__
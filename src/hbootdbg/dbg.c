@@ -35,22 +35,64 @@
 
 #include "dbg.h"
 
+#include "agent.h"
 #include "base64.h"
 #include "cpu.h"
+#include "crc32.h"
 #include "hbootlib.h"
 #include "int.h"
 #include "mmu.h"
 #include "reloc.h"
+#include "rle.h"
+#include "search.h"
+#include "step.h"
 #include "string.h"
+#include "trace.h"
 
 static dbg_status status;
 
 // Forward declarations
 breakpoint* get_breakpoint(void* addr);
+error_code remove_breakpoint(void* addr, breakpoint_type type);
+static void cmd_fill_header(response*, command*, error_code, u16, u32);
+static void send_event(event_type event, context* ctx);
+static error_code step(context* ctx);
+static int condition_true(breakpoint* bp, context* ctx);
+static void trace_hit(breakpoint* bp, context* ctx);
+static void cover(u32 addr);
+static void profile_enter(breakpoint* bp, context* ctx);
+static void profile_exit(context* ctx);
+static void sync_caches(void);
+static void dispatch(command* cmd, context* ctx);
+
+// Breakpoint table, trampoline arena and coverage bitmap reserved by the
+// linker script
+extern breakpoint __breakpoints_start[];
+extern breakpoint __breakpoints_end[];
+extern u32 __trampolines_start[];
+extern u32 __trampolines_end[];
+extern u8 __coverage_start[];
+extern u8 __coverage_end[];
 
 void dbg_init(void)
 {
+    uint slots = __breakpoints_end - __breakpoints_start;
+
     memset(&status, 0, sizeof (status));
+
+    // As many slots as fit in the table, rounded down to a power of two
+    status.bp = __breakpoints_start;
+    status.bp_slots = 1;
+    status.bp_shift = 32;
+    while (status.bp_slots * 2 <= slots)
+    {
+        status.bp_slots *= 2;
+        status.bp_shift--;
+    }
+
+    memset(status.bp, 0, status.bp_slots * sizeof (breakpoint));
+
+    status.trampoline_next = __trampolines_start;
 }
 
 /*
@@ -61,13 +103,86 @@ static
 void breakpoint_handler(context* ctx)
 {
     char buf[1024];
-    char decoded_buf[1024];
+    char decoded_buf[DBG_CMD_MAX_SIZE];
     command* cmd;
     uint read_len;
+    uint decoded_len;
+
+    breakpoint* bp;
+    char stepped = 0;
+    int hit;
+
+    // Profiled functions return through the profiling stub
+    if (status.profile_depth > 0 && ctx->pc == (u32) status.profile_return)
+    {
+        profile_exit(ctx);
+        return;
+    }
+
+    // The breakpoint planted to step is not needed anymore, the instruction
+    // it replaced runs in place. Stepping onto any breakpoint always stops.
+    if (status.step_address != NULL)
+    {
+        stepped = status.step_address == (void*) ctx->pc;
+        if (status.step_planted)
+            remove_breakpoint(status.step_address, BREAKPOINT_STEP);
+        status.step_address = NULL;
+    }
+
+    bp = get_breakpoint((void*) (ctx->pc));
+
+    // Coverage breakpoints are hit once: the instruction is marked as reached
+    // and restored, then runs in place
+    if (bp != NULL && bp->type == BREAKPOINT_COVERAGE)
+    {
+        cover(ctx->pc);
+        remove_breakpoint(bp->address, BREAKPOINT_COVERAGE);
+        bp = NULL;
+        if (!stepped)
+            return;
+    }
+
+    if (bp != NULL)
+        status.continue_address = (u32) bp->trampoline;
+    else
+        status.continue_address = stepped ? ctx->pc : ctx->pc + 4;
+    status.resume = 0;
+
+    // Resume silently when the condition is false, while hits are ignored,
+    // once a tracepoint collected its frame or a profiled function call is
+    // timed, unless stepping onto it
+    if (bp != NULL && !stepped)
+    {
+        hit = condition_true(bp, ctx);
+        if (hit)
+            bp->hits += 1;
+        if (hit && bp->ignore_count > 0)
+        {
+            bp->ignore_count -= 1;
+            hit = 0;
+        }
+
+        if (hit && bp->type == BREAKPOINT_TRACE && status.tracing)
+            trace_hit(bp, ctx);
+        if (hit && bp->type == BREAKPOINT_PROFILE && status.profiling)
+            profile_enter(bp, ctx);
+
+        if (!hit || bp->type == BREAKPOINT_TRACE
+            || bp->type == BREAKPOINT_PROFILE)
+        {
+            ctx->pc = status.continue_address;
+            return;
+        }
+    }
+
+    // Range stepping goes on without the host
+    if (stepped
+        && ctx->pc - status.step_start < status.step_end - status.step_start
+        && ++status.step_count < DBG_RANGE_STEP_MAX
+        && step(ctx) == ERROR_SUCCESS)
+        return;
 
-    breakpoint* bp = get_breakpoint((void*) (ctx->pc));
-    status.continue_address =
-        bp == NULL ? ctx->pc + 4 : (u32) bp->original_instruction;
+    send_event(EVENT_BREAKPOINT, ctx);
 
     while (1)
     {
@@ -75,20 +190,19 @@ void breakpoint_handler(context* ctx)
             read_len = __usb_recv(buf, sizeof (buf)); // non blocking
         } while (read_len == 0);
 
+        // Command is received as "oem CMD" or "keytest CMD", the prefix is
+        // stripped
         if (buf[0] == 'o')
-            base64_decode(buf + 4, decoded_buf); // Command is received as
-                                                 // "oem CMD", "buf + 4" strips
-                                                 // "oem "
+            decoded_len = base64_decode(buf + 4, decoded_buf);
         else
-            base64_decode(buf + 8, decoded_buf); // Command is received as
-                                                 // "keytest CMD", "buf + 8"
-                                                 // strips "keytest "
+            decoded_len = base64_decode(buf + 8, decoded_buf);
 
         cmd = (command*) decoded_buf;
-        cmd_dispatcher(cmd, ctx);
+        cmd_dispatcher(cmd, decoded_len, ctx);
 
-        // Continue execution, and also if the debugger is detaching
-        if (cmd->type == CMD_BREAKPOINT_CONTINUE || cmd->type == CMD_DETACH)
+        // Continue execution, and also if the debugger is detaching. This may
+        // have been requested from inside a batch.
+        if (status.resume)
             break;
     }
 }
@@ -99,6 +213,7 @@ void dbg_event_handler(event_type event, context* ctx)
     {
     case EVENT_BREAKPOINT:
         breakpoint_handler(ctx);
+        sync_caches();
         break;
 
     default:
@@ -107,74 +222,391 @@ void dbg_event_handler(event_type event, context* ctx)
     }
 }
 
+/*
+** Notify the host that the target stopped, so that it does not have to poll.
+*/
+static
+void send_event(event_type event, context* ctx)
+{
+    static u8 buf[sizeof (response) + sizeof (stop_event)];
+    response* resp = (response*) buf;
+    stop_event* evt = (stop_event*) (buf + sizeof (response));
+    command cmd;
+
+    cmd.type = CMD_EVENT;
+    cmd.seq = 0;
+    cmd_fill_header(resp, &cmd, ERROR_SUCCESS, 0, sizeof (*evt));
+
+    evt->type = event;
+    evt->pc = ctx->pc;
+    evt->cpsr = ctx->cpsr;
+
+    __usb_send((char*) buf, sizeof (buf));
+}
+
 /*
 ** Breakpoint
 */
-breakpoint* alloc_breakpoint(void)
+
+/*
+** Home slot of an address, from the high bits of a multiplicative hash.
+*/
+static
+uint hash_breakpoint(void* addr)
+{
+    return (((u32) addr >> 2) * 0x9e3779b1) >> status.bp_shift
+           & (status.bp_slots - 1);
+}
+
+/*
+** Take a free slot for a breakpoint at "addr", which must not already have one.
+** The table is kept at most 3/4 full so that probe sequences stay short.
+*/
+breakpoint* alloc_breakpoint(void* addr)
 {
-    if (status.bp_size >= DBG_NBR_POINTS)
+    uint i;
+
+    if ((status.bp_size + 1) * 4 > status.bp_slots * 3)
         return NULL;
 
+    i = hash_breakpoint(addr);
+    while (status.bp[i].address != NULL)
+        i = (i + 1) & (status.bp_slots - 1);
+
+    status.bp[i].address = addr;
     status.bp_size += 1;
 
-    return &(status.bp[status.bp_size - 1]);
+    return &(status.bp[i]);
+}
+
+/*
+** Trampolines
+*/
+
+static
+u32* alloc_trampoline(void)
+{
+    u32* trampoline = status.trampoline_free;
+
+    if (trampoline != NULL)
+        status.trampoline_free = *(u32**) trampoline;
+    else if (status.trampoline_next + RELOC_MAX_SIZE <= __trampolines_end)
+    {
+        trampoline = status.trampoline_next;
+        status.trampoline_next += RELOC_MAX_SIZE;
+    }
+
+    return trampoline;
+}
+
+static
+void free_trampoline(u32* trampoline)
+{
+    *(u32**) trampoline = status.trampoline_free;
+    status.trampoline_free = trampoline;
+}
+
+/*
+** Make the instructions patched and the trampolines written visible to
+** instruction fetches. Patched instructions are cleaned from the data cache as
+** they are written, trampolines at once over the range they span, and the
+** instruction cache is invalidated as a whole.
+*/
+static
+void sync_caches(void)
+{
+    if (status.dirty_start != NULL)
+    {
+        mmu_invalidate_dcache_range(status.dirty_start,
+                                    (u8*) status.dirty_end
+                                    - (u8*) status.dirty_start);
+        status.dirty_start = NULL;
+        status.dirty_end = NULL;
+    }
+
+    if (status.code_patched)
+    {
+        mmu_invalidate_icache();
+        status.code_patched = 0;
+    }
+}
+
+/*
+** Record that "size" words of a trampoline were written, see sync_caches.
+*/
+static
+void write_trampoline(u32* trampoline, uint size)
+{
+    if (status.dirty_start == NULL || trampoline < status.dirty_start)
+        status.dirty_start = trampoline;
+    if (trampoline + size > status.dirty_end)
+        status.dirty_end = trampoline + size;
+    status.code_patched = 1;
+}
+
+/*
+** Relocate the original instruction of a breakpoint to a new trampoline.
+** Returns an error if there is none left or if the instruction can't be
+** relocated.
+*/
+static
+error_code relocate_breakpoint(breakpoint* bp)
+{
+    uint size;
+
+    bp->trampoline = alloc_trampoline();
+    if (bp->trampoline == NULL)
+        return ERROR_NO_MEMORY_AVAILABLE;
+
+    size = relocate_instruction(bp->original_instruction, (u32) bp->address,
+                                (u32) bp->trampoline, bp->trampoline);
+    if (size == 0)
+    {
+        free_trampoline(bp->trampoline);
+        return ERROR_UNSUPPORTED;
+    }
+
+    write_trampoline(bp->trampoline, size);
+
+    return ERROR_SUCCESS;
 }
 
 /*
-** Freeing a breakpoint potentially invalidates all current breakpoint
-** pointers
+** Entries following the freed slot in its probe sequence are shifted back, so
+** that no tombstone is needed. This moves other breakpoints, invalidating
+** pointers to them.
 */
 void free_breakpoint(breakpoint* bp)
 {
-    for (uint i = 0; i < status.bp_size; ++i)
+    uint mask = status.bp_slots - 1;
+    uint hole = bp - status.bp;
+    uint i = hole;
+    uint home;
+
+    while (1)
     {
-        if (status.bp[i].address == bp->address)
+        i = (i + 1) & mask;
+        if (status.bp[i].address == NULL)
+            break;
+
+        // The entry can fill the hole unless its home slot lies cyclically in
+        // (hole, i]
+        home = hash_breakpoint(status.bp[i].address);
+        if (((i - home) & mask) >= ((i - hole) & mask))
         {
-            status.bp[i] = status.bp[status.bp_size - 1];
-            status.bp_size -= 1;
-            return;
+            status.bp[hole] = status.bp[i];
+            hole = i;
         }
     }
+
+    status.bp[hole].address = NULL;
+    status.bp_size -= 1;
 }
 
 breakpoint* get_breakpoint(void* addr)
 {
-    for (uint i = 0; i < status.bp_size; ++i)
+    uint i = hash_breakpoint(addr);
+
+    while (status.bp[i].address != NULL)
     {
         if (status.bp[i].address == addr)
             return &(status.bp[i]);
+        i = (i + 1) & (status.bp_slots - 1);
     }
 
     return NULL;
 }
 
+/*
+** Replace a breakpoint condition or tracepoint actions. These are packed in the
+** status pool, the data replaced is removed from it and what follows moved
+** down.
+*/
+static
+error_code pool_set(u16* pool_offset, u16* pool_size,
+                    const u8* data, uint size)
+{
+    uint offset = *pool_offset;
+    uint old_size = *pool_size;
+
+    if (size > DBG_POOL_SIZE - (status.pool_size - old_size))
+        return ERROR_NO_MEMORY_AVAILABLE;
+
+    memmove(status.pool + offset,
+            status.pool + offset + old_size,
+            status.pool_size - offset - old_size);
+    status.pool_size -= old_size;
+
+    for (uint i = 0; i < status.bp_slots; ++i)
+    {
+        if (status.bp[i].condition_offset > offset)
+            status.bp[i].condition_offset -= old_size;
+        if (status.bp[i].actions_offset > offset)
+            status.bp[i].actions_offset -= old_size;
+    }
+
+    *pool_offset = status.pool_size;
+    *pool_size = size;
+    memcpy(status.pool + status.pool_size, data, size);
+    status.pool_size += size;
+
+    return ERROR_SUCCESS;
+}
+
+error_code set_condition(breakpoint* bp, const u8* condition, uint size)
+{
+    return pool_set(&bp->condition_offset, &bp->condition_size,
+                    condition, size);
+}
+
+error_code set_actions(breakpoint* bp, const u8* actions, uint size)
+{
+    return pool_set(&bp->actions_offset, &bp->actions_size, actions, size);
+}
+
+/*
+** Whether the target has to stop on a breakpoint. It does if any condition is
+** true, or can't be evaluated.
+*/
+static
+int condition_true(breakpoint* bp, context* ctx)
+{
+    u8* condition = status.pool + bp->condition_offset;
+    u8* end = condition + bp->condition_size;
+    uint size;
+    u32 value;
+
+    if (condition == end)
+        return 1;
+
+    while (end - condition >= 2)
+    {
+        size = condition[0] | (condition[1] << 8);
+        condition += 2;
+        if (size > (uint) (end - condition))
+            return 1;
+
+        if (agent_eval(condition, size, ctx, NULL, &value) != AGENT_SUCCESS
+            || value != 0)
+            return 1;
+
+        condition += size;
+    }
+
+    return 0;
+}
+
+static
+void trace_memory(u32 addr, u32 size)
+{
+    if (mmu_probe_read((void*) addr, size))
+        trace_collect(TRACE_BLOCK_MEMORY, addr, (void*) addr, size);
+}
+
+/*
+** Collect a trace frame as told by the tracepoint actions. Unreadable memory is
+** skipped, and what does not fit in the frame is dropped.
+*/
+static
+void trace_hit(breakpoint* bp, context* ctx)
+{
+    u8* actions = status.pool + bp->actions_offset;
+    u8* end = actions + bp->actions_size;
+    trace_action action;
+    uint size;
+    u32 registers[17];
+    uint nbr_registers;
+    u32 value;
+
+    trace_begin(ctx->pc);
+
+    while (actions + sizeof (action) <= end)
+    {
+        memcpy(&action, actions, sizeof (action));
+        size = sizeof (action);
+
+        switch (action.type)
+        {
+        case TRACE_ACTION_REGISTERS:
+            nbr_registers = 0;
+            for (uint i = 0; i < 16; ++i)
+                if (action.value & (1 << i))
+                    registers[nbr_registers++] = ctx->r[i];
+            if (action.value & (1 << 16))
+                registers[nbr_registers++] = ctx->cpsr;
+            trace_collect(TRACE_BLOCK_REGISTERS, action.value & 0x1ffff,
+                          registers, nbr_registers * sizeof (u32));
+            break;
+
+        case TRACE_ACTION_MEMORY:
+            trace_memory((action.reg < 16 ? ctx->r[action.reg] : 0)
+                         + action.value, action.size);
+            break;
+
+        case TRACE_ACTION_EXPRESSION:
+            size += action.size;
+            if (size <= (uint) (end - actions))
+                agent_eval(actions + sizeof (action), action.size, ctx,
+                           trace_memory, &value);
+            break;
+        }
+
+        actions += (size + 3) & ~3;
+    }
+
+    trace_end();
+}
+
 error_code insert_breakpoint(void* addr, breakpoint_type type)
 {
+    error_code error;
+
     if (get_breakpoint(addr))
         return ERROR_BREAKPOINT_ALREADY_EXISTS;
 
-    breakpoint* bp = alloc_breakpoint();
+    breakpoint* bp = alloc_breakpoint(addr);
     if (bp == NULL)
         return ERROR_NO_MEMORY_AVAILABLE;
 
     bp->type    = type;
-    bp->address = addr;
     bp->enabled = 1;
-    bp->original_instruction[0] = *(u32*) addr;
+    bp->condition_offset = status.pool_size;
+    bp->condition_size = 0;
+    bp->actions_offset = status.pool_size;
+    bp->actions_size = 0;
+    bp->profile = 0;
+    bp->hits = 0;
+    bp->ignore_count = 0;
+    bp->original_instruction = *(u32*) addr;
+
+    if (type == BREAKPOINT_PROFILE)
+    {
+        if (status.profile_count == DBG_PROFILE_MAX)
+        {
+            free_breakpoint(bp);
+            return ERROR_NO_MEMORY_AVAILABLE;
+        }
+        bp->profile = status.profile_count;
+    }
 
-    // This solution is temporary as it just won't work with instructions
-    // that manipulate PC
-    bp->original_instruction[1] = cpu_get_branch(
-            (u32) &(bp->original_instruction[1]),
-            (u32) &((u32*) addr)[1]
-    );
+    error = relocate_breakpoint(bp);
+    if (error != ERROR_SUCCESS)
+    {
+        free_breakpoint(bp);
+        return error;
+    }
 
-    // Invalidate caches
-    mmu_invalidate_cache_line(&bp->original_instruction[0]);
-    mmu_invalidate_cache_line(&bp->original_instruction[1]);
+    if (type == BREAKPOINT_PROFILE)
+    {
+        status.profiles[bp->profile].address = (u32) addr;
+        status.profiles[bp->profile].calls = 0;
+        status.profiles[bp->profile].cycles = 0;
+        status.profile_count += 1;
+    }
 
     *(u32*) addr = ARM_BKPT;
-    mmu_invalidate_cache_line(addr);
+    mmu_invalidate_dcache_line(addr);
+    status.code_patched = 1;
 
     return ERROR_SUCCESS;
 }
@@ -187,19 +619,102 @@ error_code remove_breakpoint(void* addr, breakpoint_type type)
     if (bp == NULL)
         return ERROR_NO_BREAKPOINT;
 
-    *(u32*) addr = bp->original_instruction[0];
-    mmu_invalidate_cache_line(addr);
+    set_condition(bp, NULL, 0);
+    set_actions(bp, NULL, 0);
+
+    *(u32*) addr = bp->original_instruction;
+    mmu_invalidate_dcache_line(addr);
+    status.code_patched = 1;
+
+    // Resuming from the breakpoint now runs the instruction in place
+    if (status.continue_address == (u32) bp->trampoline)
+        status.continue_address = (u32) addr;
 
+    // The profile table is kept packed, the last entry takes the freed one
+    if (bp->type == BREAKPOINT_PROFILE)
+    {
+        status.profile_count -= 1;
+        status.profiles[bp->profile] = status.profiles[status.profile_count];
+        get_breakpoint((void*) status.profiles[bp->profile].address)->profile
+            = bp->profile;
+    }
+
+    free_trampoline(bp->trampoline);
     free_breakpoint(bp);
 
     return ERROR_SUCCESS;
 }
 
+/*
+** Mark the instruction at addr as reached in the coverage bitmap.
+*/
+static
+void cover(u32 addr)
+{
+    u32 i = (addr - status.coverage_start) / 4;
+
+    if (addr - status.coverage_start < status.coverage_size)
+        __coverage_start[i / 8] |= 1 << (i % 8);
+}
+
+/*
+** Count a call of a profiled function, and time it unless too many calls are
+** nested: it returns to the profiling stub instead of its caller.
+*/
+static
+void profile_enter(breakpoint* bp, context* ctx)
+{
+    profile_call* call;
+
+    status.profiles[bp->profile].calls += 1;
+    if (status.profile_depth == DBG_PROFILE_DEPTH)
+        return;
+
+    call = &(status.profile_calls[status.profile_depth++]);
+    call->function = bp->address;
+    call->lr = ctx->lr;
+    ctx->lr = (u32) status.profile_return;
+
+    // Read last, so that the debugger is left out of the time as much as
+    // possible
+    call->start = cpu_get_cycle_counter();
+}
+
+/*
+** Return of the innermost profiled call, to its actual caller.
+*/
+static
+void profile_exit(context* ctx)
+{
+    u32 end = cpu_get_cycle_counter();
+    profile_call* call = &(status.profile_calls[--status.profile_depth]);
+    breakpoint* bp = get_breakpoint(call->function);
+
+    if (bp != NULL && bp->type == BREAKPOINT_PROFILE)
+        status.profiles[bp->profile].cycles += end - call->start;
+
+    ctx->pc = call->lr & ~1;
+    if (call->lr & 1)
+        ctx->cpsr |= ARM_SPR_THUMB;
+}
+
 /*
 ** Commands
 */
 
-void cmd_dispatcher(command* cmd, context* ctx)
+/*
+** Code patched by a command, a batch included, is made executable once it is
+** done.
+*/
+void cmd_dispatcher(command* cmd, uint size, context* ctx)
+{
+    status.cmd_size = size;
+    dispatch(cmd, ctx);
+    sync_caches();
+}
+
+static
+void dispatch(command* cmd, context* ctx)
 {
     switch (cmd->type)
     {
@@ -215,10 +730,78 @@ void cmd_dispatcher(command* cmd, context* ctx)
         cmd_read(cmd, ctx);
         break;
 
+    case CMD_READ_RLE:
+        cmd_read_rle(cmd, ctx);
+        break;
+
+    case CMD_READV:
+        cmd_readv(cmd, ctx);
+        break;
+
+    case CMD_SEARCH:
+        cmd_search(cmd, ctx);
+        break;
+
+    case CMD_CHECKSUM:
+        cmd_checksum(cmd, ctx);
+        break;
+
+    case CMD_MEMORY_MAP:
+        cmd_memory_map(cmd, ctx);
+        break;
+
+    case CMD_TRACE_ACTIONS:
+        cmd_trace_actions(cmd, ctx);
+        break;
+
+    case CMD_TRACE_START:
+        cmd_trace_start(cmd, ctx);
+        break;
+
+    case CMD_TRACE_STOP:
+        cmd_trace_stop(cmd, ctx);
+        break;
+
+    case CMD_TRACE_DUMP:
+        cmd_trace_dump(cmd, ctx);
+        break;
+
+    case CMD_COVERAGE:
+        cmd_coverage(cmd, ctx);
+        break;
+
+    case CMD_PROFILE_START:
+        cmd_profile_start(cmd, ctx);
+        break;
+
+    case CMD_PROFILE_STOP:
+        cmd_profile_stop(cmd, ctx);
+        break;
+
+    case CMD_PROFILE_DUMP:
+        cmd_profile_dump(cmd, ctx);
+        break;
+
+    case CMD_IGNORE_COUNT:
+        cmd_ignore_count(cmd, ctx);
+        break;
+
+    case CMD_BREAKPOINT_COUNTERS:
+        cmd_breakpoint_counters(cmd, ctx);
+        break;
+
     case CMD_WRITE:
         cmd_write(cmd, ctx);
         break;
 
+    case CMD_WRITE_BEGIN:
+        cmd_write_begin(cmd, ctx);
+        break;
+
+    case CMD_WRITE_DATA:
+        cmd_write_data(cmd, ctx);
+        break;
+
     case CMD_INSERT_BREAKPOINT:
         cmd_insert_breakpoint(cmd, ctx);
         break;
@@ -227,14 +810,34 @@ void cmd_dispatcher(command* cmd, context* ctx)
         cmd_remove_breakpoint(cmd, ctx);
         break;
 
+    case CMD_INSERT_BREAKPOINTS:
+        cmd_insert_breakpoints(cmd, ctx);
+        break;
+
+    case CMD_REMOVE_BREAKPOINTS:
+        cmd_remove_breakpoints(cmd, ctx);
+        break;
+
     case CMD_GET_REGISTERS:
         cmd_get_registers(cmd, ctx);
         break;
 
+    case CMD_SET_REGISTERS:
+        cmd_set_registers(cmd, ctx);
+        break;
+
     case CMD_BREAKPOINT_CONTINUE:
         cmd_breakpoint_continue(cmd, ctx);
         break;
 
+    case CMD_STEP:
+        cmd_step(cmd, ctx);
+        break;
+
+    case CMD_BATCH:
+        cmd_batch(cmd, ctx);
+        break;
+
     case CMD_CALL:
         cmd_call(cmd, ctx);
         break;
@@ -257,15 +860,60 @@ void cmd_dispatcher(command* cmd, context* ctx)
     }
 }
 
-inline void cmd_success(command* cmd)
-{
+/*
+** Whether the "size" bytes at "data" were all decoded with the command being
+** dispatched, for the ones it gives the size of.
+*/
+static
+int cmd_holds(command* cmd, const void* data, u32 size)
+{
+    u32 offset = (const u8*) data - (const u8*) cmd;
+
+    return offset <= status.cmd_size && size <= status.cmd_size - offset;
+}
+
+inline void cmd_success(command* cmd)
+{
     cmd_error(cmd, ERROR_SUCCESS);
 }
 
 void cmd_error(command* cmd, error_code error)
+{
+    cmd_reply(cmd, error, 0);
+}
+
+static
+void cmd_fill_header(response* resp,
+                     command* cmd,
+                     error_code error,
+                     u16 flags,
+                     u32 size)
 {
     cmd->error = error;
-    __usb_send((char*) cmd, 2);
+
+    resp->magic = RESPONSE_MAGIC;
+    resp->seq = cmd->seq;
+    resp->type = cmd->type;
+    resp->error = error;
+    resp->flags = flags;
+    resp->size = size;
+}
+
+static
+void cmd_send_header(command* cmd, error_code error, u16 flags, u32 size)
+{
+    response resp;
+
+    cmd_fill_header(&resp, cmd, error, flags, size);
+    __usb_send((char*) &resp, sizeof (resp));
+}
+
+/*
+** Send the response header, "size" bytes of payload must follow.
+*/
+void cmd_reply(command* cmd, error_code error, u32 size)
+{
+    cmd_send_header(cmd, error, 0, size);
 }
 
 void cmd_attach(command* cmd, context* ctx)
@@ -281,6 +929,7 @@ void cmd_detach(command* cmd, context* ctx)
 {
     (void) ctx;
 
+    status.resume = 1;
     cmd_success(cmd);
 }
 
@@ -299,7 +948,7 @@ void cmd_read(command* cmd, context* ctx)
         return;
     }
 
-    cmd_success(cmd);
+    cmd_reply(cmd, ERROR_SUCCESS, count);
 
     while (count > 0)
     {
@@ -310,6 +959,270 @@ void cmd_read(command* cmd, context* ctx)
     }
 }
 
+/*
+** Same as cmd_read, but data is compressed block by block. Compressed blocks
+** are packed in response parts of at most 1024 bytes which are sent as soon as
+** full, so the range is only read once.
+*/
+void cmd_read_rle(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    static u8 buf[sizeof (response) + 1024];
+    response* resp = (response*) buf;
+    u8* part = buf + sizeof (response);
+    u8* addr = cmd->read.addr;
+    u32 count = cmd->read.size;
+    u32 len;
+    uint size = 0;
+
+    if (!mmu_probe_read(addr, count))
+    {
+        cmd_error(cmd, ERROR_UNMAPPED_MEMORY);
+        return;
+    }
+
+    do {
+        len = count < RLE_BLOCK_SIZE ? count : RLE_BLOCK_SIZE;
+        size += rle_compress(addr, len, part + size);
+        count -= len;
+        addr += len;
+
+        if (count == 0)
+            cmd_fill_header(resp, cmd, ERROR_SUCCESS, 0, size);
+        else if (size + RLE_MAX_SIZE(RLE_BLOCK_SIZE) > 1024)
+            cmd_fill_header(resp, cmd, ERROR_SUCCESS, RESPONSE_MORE, size);
+        else
+            continue;
+
+        __usb_send((char*) buf, sizeof (response) + size);
+        size = 0;
+    } while (count > 0);
+}
+
+/*
+** Read several ranges at once. The response holds the error code of every range
+** (padded to 4 bytes), followed by the data of the readable ones back to back.
+** Everything is packed in transfers of at most 1024 bytes, the header included,
+** so that many small ranges cost a single transfer.
+*/
+void cmd_readv(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    static u8 buf[sizeof (response) + 1024];
+    static u8 errors[(DBG_READV_MAX + 3) & ~3];
+    u32 count = cmd->readv.count;
+    uint used = sizeof (response) + ((count + 3) & ~3);
+    u32 size = 0;
+    u8* addr;
+    u32 remaining;
+    u32 len;
+
+    if (count > DBG_READV_MAX)
+    {
+        cmd_error(cmd, ERROR_MALFORMED_CMD);
+        return;
+    }
+
+    for (uint i = 0; i < count; ++i)
+    {
+        if (mmu_probe_read(cmd->readv.ranges[i].addr,
+                           cmd->readv.ranges[i].size))
+        {
+            errors[i] = ERROR_SUCCESS;
+            size += cmd->readv.ranges[i].size;
+        }
+        else
+            errors[i] = ERROR_UNMAPPED_MEMORY;
+    }
+
+    for (uint i = count; i < ((count + 3) & ~3); ++i)
+        errors[i] = 0;
+
+    cmd_fill_header((response*) buf, cmd, ERROR_SUCCESS, 0,
+                    used - sizeof (response) + size);
+    memcpy(buf + sizeof (response), errors, used - sizeof (response));
+
+    for (uint i = 0; i < count; ++i)
+    {
+        if (errors[i] != ERROR_SUCCESS)
+            continue;
+
+        addr = cmd->readv.ranges[i].addr;
+        remaining = cmd->readv.ranges[i].size;
+
+        while (remaining > 0)
+        {
+            len = sizeof (buf) - used;
+            len = remaining < len ? remaining : len;
+            memcpy(buf + used, addr, len);
+            used += len;
+            addr += len;
+            remaining -= len;
+
+            if (used == sizeof (buf))
+            {
+                __usb_send((char*) buf, used);
+                used = 0;
+            }
+        }
+    }
+
+    if (used > 0)
+        __usb_send((char*) buf, used);
+}
+
+/*
+** End of the section holding "addr", or "end" if it comes first.
+*/
+static
+u8* section_end(u8* addr, u8* end)
+{
+    u8* next = (u8*) (((u32) addr + MMU_PAGE_SECTION_SIZE)
+                      & ~(MMU_PAGE_SECTION_SIZE - 1));
+
+    return next > addr && next < end ? next : end;
+}
+
+/*
+** Look for a pattern in memory, and send back the address of every hit (up to
+** max_hits). Unmapped sections are skipped, a hit can't span them.
+*/
+void cmd_search(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    static u32 hits[DBG_SEARCH_MAX_HITS];
+    static search_pattern pattern;
+    u8* addr = cmd->search.addr;
+    u8* end = addr + cmd->search.size;
+    u8* span_end;
+    u8* hit;
+    uint size = cmd->search.pattern_size;
+    uint max_hits = cmd->search.max_hits;
+    uint count = 0;
+
+    if (size == 0 || size > SEARCH_MAX_PATTERN || max_hits == 0)
+    {
+        cmd_error(cmd, ERROR_MALFORMED_CMD);
+        return;
+    }
+
+    search_init(&pattern,
+                cmd->search.data,
+                cmd->search.masked ? cmd->search.data + size : NULL,
+                size);
+
+    while (addr < end && count < max_hits)
+    {
+        // Gather a span of consecutive readable sections
+        span_end = addr;
+        while (span_end < end && mmu_probe_read(span_end, 1))
+            span_end = section_end(span_end, end);
+
+        if (span_end == addr)
+        {
+            addr = section_end(addr, end);
+            continue;
+        }
+
+        while (count < max_hits)
+        {
+            hit = (u8*) search_next(&pattern, addr, span_end);
+            if (hit == span_end)
+                break;
+
+            hits[count++] = (u32) hit;
+            addr = hit + 1;
+        }
+
+        addr = span_end;
+    }
+
+    cmd_reply(cmd, ERROR_SUCCESS, count * sizeof (u32));
+    __usb_send((char*) hits, count * sizeof (u32));
+}
+
+/*
+** Compute GDB compatible CRC-32 over a range, or over each block of it, so that
+** the host can tell whether memory changed without reading it back.
+*/
+void cmd_checksum(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    static u32 crcs[256];
+    u8* addr = cmd->checksum.addr;
+    u32 count = cmd->checksum.size;
+    u32 block_size = cmd->checksum.block_size;
+    u32 len;
+    uint nbr_crcs = 0;
+
+    if (!mmu_probe_read(addr, count))
+    {
+        cmd_error(cmd, ERROR_UNMAPPED_MEMORY);
+        return;
+    }
+
+    if (block_size == 0 || block_size > count)
+        block_size = count;
+
+    // An empty range still gets one CRC
+    cmd_reply(cmd, ERROR_SUCCESS,
+              count == 0 ? sizeof (u32) :
+              (count + block_size - 1) / block_size * sizeof (u32));
+
+    do {
+        len = count < block_size ? count : block_size;
+        crcs[nbr_crcs++] = crc32(CRC32_INIT, addr, len);
+        count -= len;
+        addr += len;
+
+        if (nbr_crcs == sizeof (crcs) / sizeof (crcs[0]) || count == 0)
+        {
+            __usb_send((char*) crcs, nbr_crcs * sizeof (u32));
+            nbr_crcs = 0;
+        }
+    } while (count > 0);
+}
+
+/*
+** Send the mapped regions of the translation table, as a list of mmu_region.
+** The table is walked once, regions are sent in parts of at most 1024 bytes as
+** they are found.
+*/
+void cmd_memory_map(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    static u8 buf[sizeof (response) + 1024];
+    response* resp = (response*) buf;
+    mmu_region* regions = (mmu_region*) (buf + sizeof (response));
+    uint max_regions = 1024 / sizeof (mmu_region);
+    uint nbr_regions = 0;
+    uint section = 0;
+
+    do {
+        section = mmu_next_region(section, &regions[nbr_regions]);
+        if (regions[nbr_regions].count > 0)
+            nbr_regions++;
+
+        if (section == MMU_SECTIONS_NR)
+            cmd_fill_header(resp, cmd, ERROR_SUCCESS, 0,
+                            nbr_regions * sizeof (mmu_region));
+        else if (nbr_regions == max_regions)
+            cmd_fill_header(resp, cmd, ERROR_SUCCESS, RESPONSE_MORE,
+                            nbr_regions * sizeof (mmu_region));
+        else
+            continue;
+
+        __usb_send((char*) buf,
+                   sizeof (response) + nbr_regions * sizeof (mmu_region));
+        nbr_regions = 0;
+    } while (section < MMU_SECTIONS_NR);
+}
+
 void cmd_write(command* cmd, context* ctx)
 {
     (void) ctx;
@@ -330,12 +1243,100 @@ void cmd_write(command* cmd, context* ctx)
     cmd_success(cmd);
 }
 
+/*
+** Bulk writes are streamed: CMD_WRITE_BEGIN announces the destination and the
+** total length, then CMD_WRITE_DATA chunks are applied in order. Only the last
+** chunk (or the first error) is acknowledged, and caches are invalidated once
+** for the whole range.
+*/
+void cmd_write_begin(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    write_stream* stream = &status.stream;
+
+    stream->addr = cmd->write_begin.addr;
+    stream->size = 0;
+    stream->written = 0;
+
+    if (!mmu_probe_read(stream->addr, cmd->write_begin.size))
+    {
+        cmd_error(cmd, ERROR_UNMAPPED_MEMORY);
+        return;
+    }
+
+    stream->size = cmd->write_begin.size;
+    cmd_success(cmd);
+}
+
+void cmd_write_data(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    write_stream* stream = &status.stream;
+    u32 offset = cmd->write_data.offset;
+    u32 size = cmd->write_data.size;
+
+    if (offset != stream->written || size > stream->size - offset
+        || !cmd_holds(cmd, cmd->write_data.data, size))
+    {
+        stream->size = 0;
+        stream->written = 0;
+        cmd_error(cmd, ERROR_MALFORMED_CMD);
+        return;
+    }
+
+    memcpy(stream->addr + offset, cmd->write_data.data, size);
+    stream->written += size;
+
+    if (stream->written == stream->size)
+    {
+        mmu_invalidate_cache_range(stream->addr, stream->size);
+        stream->size = 0;
+        stream->written = 0;
+    }
+
+    // Acknowledged so that the host sends the next chunk only once this one
+    // is out of the receive buffer
+    cmd_success(cmd);
+}
+
+/*
+** Inserting a breakpoint again only replaces its condition, as GDB does to
+** update conditions.
+*/
 void cmd_insert_breakpoint(command* cmd, context* ctx)
 {
     (void) ctx;
 
-    error_code err =
-        insert_breakpoint(cmd->breakpoint.addr, cmd->breakpoint.type);
+    breakpoint* bp = get_breakpoint(cmd->breakpoint.addr);
+    char inserted = bp == NULL;
+    error_code err = ERROR_SUCCESS;
+
+    // The pool is bounded by set_condition
+    if (!cmd_holds(cmd, cmd->breakpoint.condition,
+                   cmd->breakpoint.condition_size))
+    {
+        cmd_error(cmd, ERROR_MALFORMED_CMD);
+        return;
+    }
+
+    if (inserted)
+    {
+        err = insert_breakpoint(cmd->breakpoint.addr, cmd->breakpoint.type);
+        bp = get_breakpoint(cmd->breakpoint.addr);
+    }
+    else if (bp->type != cmd->breakpoint.type)
+        err = ERROR_BREAKPOINT_ALREADY_EXISTS;
+
+    if (err == ERROR_SUCCESS)
+    {
+        err = set_condition(bp,
+                            cmd->breakpoint.condition,
+                            cmd->breakpoint.condition_size);
+        if (err != ERROR_SUCCESS && inserted)
+            remove_breakpoint(cmd->breakpoint.addr, cmd->breakpoint.type);
+    }
 
     cmd_error(cmd, err);
 }
@@ -350,17 +1351,359 @@ void cmd_remove_breakpoint(command* cmd, context* ctx)
     cmd_error(cmd, err);
 }
 
+/*
+** Insert or remove breakpoints at every address of the command, replying with
+** a bitmap of the ones which were, padded to 4 bytes. The caches are only
+** synchronized once all of them are patched.
+*/
+static
+void update_breakpoints(command* cmd, int insert)
+{
+    static u8 done[((DBG_BREAKPOINTS_MAX + 31) & ~31) / 8];
+    u32 count = cmd->breakpoints.count;
+    uint size = ((count + 31) & ~31) / 8;
+    breakpoint* bp;
+    error_code err;
+
+    if (count > DBG_BREAKPOINTS_MAX)
+    {
+        cmd_error(cmd, ERROR_MALFORMED_CMD);
+        return;
+    }
+
+    memset(done, 0, size);
+
+    for (uint i = 0; i < count; ++i)
+    {
+        if (insert)
+        {
+            // Inserting a breakpoint of the same type again succeeds, but
+            // keeps its condition
+            bp = get_breakpoint(cmd->breakpoints.addr[i]);
+            if (bp != NULL)
+                err = bp->type == cmd->breakpoints.type
+                      ? ERROR_SUCCESS : ERROR_BREAKPOINT_ALREADY_EXISTS;
+            else
+                err = insert_breakpoint(cmd->breakpoints.addr[i],
+                                        cmd->breakpoints.type);
+        }
+        else
+            err = remove_breakpoint(cmd->breakpoints.addr[i],
+                                    cmd->breakpoints.type);
+
+        if (err == ERROR_SUCCESS)
+            done[i / 8] |= 1 << (i % 8);
+    }
+
+    cmd_reply(cmd, ERROR_SUCCESS, size);
+    __usb_send((char*) done, size);
+}
+
+void cmd_insert_breakpoints(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    update_breakpoints(cmd, 1);
+}
+
+void cmd_remove_breakpoints(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    update_breakpoints(cmd, 0);
+}
+
+/*
+** Set the actions of a tracepoint, inserted beforehand as a breakpoint of type
+** BREAKPOINT_TRACE.
+*/
+void cmd_trace_actions(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    breakpoint* bp = get_breakpoint(cmd->trace_actions.addr);
+
+    if (bp == NULL || bp->type != BREAKPOINT_TRACE)
+    {
+        cmd_error(cmd, ERROR_NO_BREAKPOINT);
+        return;
+    }
+
+    // The pool is bounded by set_actions
+    if (!cmd_holds(cmd, cmd->trace_actions.actions, cmd->trace_actions.size))
+    {
+        cmd_error(cmd, ERROR_MALFORMED_CMD);
+        return;
+    }
+
+    cmd_error(cmd, set_actions(bp,
+                               cmd->trace_actions.actions,
+                               cmd->trace_actions.size));
+}
+
+/*
+** Tracepoints only collect frames between CMD_TRACE_START and CMD_TRACE_STOP.
+** Frames of a previous run are discarded on start.
+*/
+void cmd_trace_start(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    trace_clear();
+    status.tracing = 1;
+    cmd_success(cmd);
+}
+
+void cmd_trace_stop(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    status.tracing = 0;
+    cmd_success(cmd);
+}
+
+/*
+** Send the collected trace frames from the oldest, and empty the buffer.
+*/
+void cmd_trace_dump(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    const u8* parts[2];
+    uint sizes[2];
+    uint nbr_parts = trace_get(parts, sizes);
+    u32 block_size = 1024;
+    u32 len;
+
+    cmd_reply(cmd, ERROR_SUCCESS,
+              nbr_parts == 0 ? 0 : sizes[0] + (nbr_parts == 2 ? sizes[1] : 0));
+
+    for (uint i = 0; i < nbr_parts; ++i)
+    {
+        while (sizes[i] > 0)
+        {
+            len = sizes[i] < block_size ? sizes[i] : block_size;
+            __usb_send((char*) parts[i], len);
+            sizes[i] -= len;
+            parts[i] += len;
+        }
+    }
+
+    trace_clear();
+}
+
+/*
+** Start recording which instructions of a range coverage breakpoints are hit
+** at, replying with the address of the bitmap so that the host reads it back
+** directly.
+*/
+void cmd_coverage(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    u32 size = cmd->coverage.size;
+    u32 bitmap = (u32) __coverage_start;
+
+    if ((size / 4 + 7) / 8 > (u32) (__coverage_end - __coverage_start))
+    {
+        cmd_error(cmd, ERROR_NO_MEMORY_AVAILABLE);
+        return;
+    }
+
+    status.coverage_start = (u32) cmd->coverage.addr;
+    status.coverage_size = size;
+    memset(__coverage_start, 0, (size / 4 + 7) / 8);
+
+    cmd_reply(cmd, ERROR_SUCCESS, sizeof (bitmap));
+    __usb_send((char*) &bitmap, sizeof (bitmap));
+}
+
+/*
+** Time the functions at BREAKPOINT_PROFILE breakpoints from now on, with the
+** cycle counter. Their counters are reset.
+*/
+void cmd_profile_start(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    // The stub is never freed, calls timed may be in progress
+    if (status.profile_return == NULL)
+    {
+        status.profile_return = alloc_trampoline();
+        if (status.profile_return == NULL)
+        {
+            cmd_error(cmd, ERROR_NO_MEMORY_AVAILABLE);
+            return;
+        }
+        *status.profile_return = ARM_BKPT;
+        write_trampoline(status.profile_return, 1);
+    }
+
+    for (uint i = 0; i < status.profile_count; ++i)
+    {
+        status.profiles[i].calls = 0;
+        status.profiles[i].cycles = 0;
+    }
+
+    cpu_enable_cycle_counter();
+    status.profiling = 1;
+    cmd_success(cmd);
+}
+
+/*
+** Calls in progress still go back through the stub, but new ones aren't timed
+** anymore.
+*/
+void cmd_profile_stop(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    status.profiling = 0;
+    cmd_success(cmd);
+}
+
+/*
+** Reply with a profile_entry per BREAKPOINT_PROFILE breakpoint.
+*/
+void cmd_profile_dump(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    char* data = (char*) status.profiles;
+    u32 count = status.profile_count * sizeof (profile_entry);
+    u32 len;
+
+    cmd_reply(cmd, ERROR_SUCCESS, count);
+
+    while (count > 0)
+    {
+        len = count < 1024 ? count : 1024;
+        __usb_send(data, len);
+        count -= len;
+        data += len;
+    }
+}
+
+void cmd_ignore_count(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    breakpoint* bp = get_breakpoint(cmd->ignore_count.addr);
+
+    if (bp == NULL)
+    {
+        cmd_error(cmd, ERROR_NO_BREAKPOINT);
+        return;
+    }
+
+    bp->ignore_count = cmd->ignore_count.count;
+    cmd_success(cmd);
+}
+
+/*
+** Reply with a breakpoint_counter per breakpoint, in no particular order.
+*/
+void cmd_breakpoint_counters(command* cmd, context* ctx)
+{
+    (void) ctx;
+
+    static breakpoint_counter counters[1024 / sizeof (breakpoint_counter)];
+    uint nbr_counters = 0;
+    breakpoint* bp;
+
+    cmd_reply(cmd, ERROR_SUCCESS,
+              status.bp_size * sizeof (breakpoint_counter));
+
+    for (uint i = 0; i < status.bp_slots; ++i)
+    {
+        bp = &(status.bp[i]);
+        if (bp->address == NULL)
+            continue;
+
+        counters[nbr_counters].address = (u32) bp->address;
+        counters[nbr_counters].type = bp->type;
+        counters[nbr_counters].reserved[0] = 0;
+        counters[nbr_counters].reserved[1] = 0;
+        counters[nbr_counters].reserved[2] = 0;
+        counters[nbr_counters].hits = bp->hits;
+        counters[nbr_counters].ignore_count = bp->ignore_count;
+        if (cmd->breakpoint_counters.reset)
+            bp->hits = 0;
+
+        if (++nbr_counters == sizeof (counters) / sizeof (counters[0]))
+        {
+            __usb_send((char*) counters, sizeof (counters));
+            nbr_counters = 0;
+        }
+    }
+
+    if (nbr_counters > 0)
+        __usb_send((char*) counters,
+                   nbr_counters * sizeof (breakpoint_counter));
+}
+
 void cmd_get_registers(command* cmd, context* ctx)
 {
     if (ctx == NULL)
         cmd_error(cmd, ERROR_NO_BREAKPOINT);
     else
     {
-        cmd_success(cmd);
+        cmd_reply(cmd, ERROR_SUCCESS, sizeof (*ctx));
         __usb_send((char*) ctx, sizeof (*ctx));
     }
 }
 
+/*
+** Write registers into the saved context, they are restored when resuming. sp
+** can't be written since the context is saved on the stack it points to, and
+** only the condition flags of cpsr can.
+*/
+void cmd_set_registers(command* cmd, context* ctx)
+{
+    u32 mask = cmd->set_registers.mask;
+    // The values are not necessarily aligned
+    const u8* values = (const u8*) cmd->set_registers.values;
+    u32 value;
+    breakpoint* bp;
+
+    if (ctx == NULL)
+    {
+        cmd_error(cmd, ERROR_NO_BREAKPOINT);
+        return;
+    }
+
+    if (mask & ((1 << 13) | ~0x1ffff))
+    {
+        cmd_error(cmd, ERROR_MALFORMED_CMD);
+        return;
+    }
+
+    for (uint i = 0; i < 16; ++i)
+        if (mask & (1 << i))
+        {
+            memcpy(&value, values, sizeof (value));
+            values += sizeof (value);
+            ctx->r[i] = value;
+        }
+
+    // Resuming always goes through continue_address
+    if (mask & (1 << 15))
+    {
+        bp = get_breakpoint((void*) ctx->pc);
+        status.continue_address =
+            bp == NULL ? ctx->pc : (u32) bp->trampoline;
+    }
+
+    if (mask & (1 << 16))
+    {
+        memcpy(&value, values, sizeof (value));
+        ctx->cpsr = (ctx->cpsr & ~ARM_SPR_COND_FLAGS)
+                  | (value & ARM_SPR_COND_FLAGS);
+    }
+
+    cmd_success(cmd);
+}
+
 void cmd_breakpoint_continue(command* cmd, context* ctx)
 {
     if (ctx == NULL)
@@ -368,10 +1711,141 @@ void cmd_breakpoint_continue(command* cmd, context* ctx)
     else
     {
         ctx->pc = status.continue_address;
+        status.resume = 1;
         cmd_success(cmd);
     }
 }
 
+/*
+** Execute a single instruction from the stopped context. Its successor is
+** computed and a temporary breakpoint is planted there, so that branches, loads
+** to pc and returns are followed.
+*/
+static
+error_code step(context* ctx)
+{
+    breakpoint* bp;
+    u32 pc;
+    u32 instr;
+    u32 next;
+    error_code error;
+
+    // The instruction either runs out of line in place of a breakpoint, or
+    // from where execution resumes
+    bp = get_breakpoint((void*) ctx->pc);
+    pc = bp != NULL ? ctx->pc : status.continue_address;
+    if (bp == NULL && !mmu_probe_read((void*) pc, sizeof (u32)))
+        return ERROR_UNMAPPED_MEMORY;
+    instr = bp != NULL ? bp->original_instruction : *(u32*) pc;
+    if (step_next_pc(ctx, instr, pc, &next) != 0)
+        return ERROR_UNMAPPED_MEMORY;
+
+    // Returning from a timed call goes through the profiling stub, which
+    // resumes at the caller without stopping
+    if (status.profile_depth > 0 && next == (u32) status.profile_return)
+        next = status.profile_calls[status.profile_depth - 1].lr;
+
+    // Thumb code can't be stepped with ARM breakpoints
+    if (next & 3)
+        return ERROR_UNSUPPORTED;
+
+    // A breakpoint already there stops the step as well
+    status.step_planted = get_breakpoint((void*) next) == NULL;
+    if (status.step_planted)
+    {
+        error = insert_breakpoint((void*) next, BREAKPOINT_STEP);
+        if (error != ERROR_SUCCESS)
+            return error;
+    }
+    status.step_address = (void*) next;
+
+    ctx->pc = status.continue_address;
+    return ERROR_SUCCESS;
+}
+
+/*
+** Step once, or until pc leaves a range. Stepping in the range is done by the
+** breakpoint handler without involving the host, which is notified of the
+** final stop as for any breakpoint.
+*/
+void cmd_step(command* cmd, context* ctx)
+{
+    error_code error;
+
+    if (ctx == NULL)
+    {
+        cmd_error(cmd, ERROR_NO_BREAKPOINT);
+        return;
+    }
+
+    status.step_start = cmd->step.start;
+    status.step_end = cmd->step.end;
+    status.step_count = 0;
+
+    error = step(ctx);
+    if (error != ERROR_SUCCESS)
+    {
+        cmd_error(cmd, error);
+        return;
+    }
+
+    status.resume = 1;
+    cmd_success(cmd);
+}
+
+/*
+** Run every sub-command in order. Each one sends its own response, then the
+** batch itself is answered with the error code of every entry.
+*/
+void cmd_batch(command* cmd, context* ctx)
+{
+    static u8 errors[DBG_BATCH_MAX];
+    u32 count = cmd->batch.count;
+    u8* entry = cmd->batch.entries;
+    u8* end = entry + cmd->batch.size;
+    command* sub;
+    u32 size;
+
+    // The entries can't go past the buffer the batch was decoded in
+    if (count > DBG_BATCH_MAX
+        || cmd->batch.size
+           > DBG_CMD_MAX_SIZE - offsetof(command, batch.entries))
+    {
+        cmd_error(cmd, ERROR_MALFORMED_CMD);
+        return;
+    }
+
+    for (uint i = 0; i < count; ++i)
+    {
+        if (entry + sizeof (u32) > end)
+        {
+            cmd_error(cmd, ERROR_MALFORMED_CMD);
+            return;
+        }
+
+        size = *(u32*) entry;
+        sub = (command*) (entry + sizeof (u32));
+
+        if (size < offsetof(command, read) || size > (u32) (end - (u8*) sub))
+        {
+            cmd_error(cmd, ERROR_MALFORMED_CMD);
+            return;
+        }
+
+        status.cmd_size = size;
+        if (sub->type == CMD_BATCH)
+            cmd_error(sub, ERROR_MALFORMED_CMD);
+        else
+            dispatch(sub, ctx);
+
+        errors[i] = sub->error;
+        entry = (u8*) sub + ((size + 3) & ~3);
+    }
+
+    cmd_reply(cmd, ERROR_SUCCESS, count);
+    __usb_send((char*) errors, count);
+}
+
 void cmd_breakpoint(command* cmd, context* ctx)
 {
     (void) ctx;
@@ -395,6 +1869,9 @@ void cmd_call(command* cmd, context* ctx)
     void* addr = cmd->call.addr;
     u32* args = cmd->call.args;
 
+    // The function called may hit breakpoints inserted by the same batch
+    sync_caches();
+
     ASM(
         "push {r0-r4}\n"
         "ldr r4, %[function]\n"
@@ -410,7 +1887,10 @@ void cmd_call(command* cmd, context* ctx)
           [arg1] "m" (args[1]),
           [arg2] "m" (args[2]),
           [arg3] "m" (args[3])
+        : "r12", "lr", "memory"
     );
+
+    cmd_success(cmd);
 }
 
 void cmd_fastboot_reboot(command* cmd, context* ctx)
@@ -38,9 +38,25 @@
 
 # include "cpu.h"
 # include "int.h"
+# include "reloc.h"
 # include <stddef.h>
 
-#define DBG_NBR_POINTS  64
+// Size of the buffers commands are decoded in
+#define DBG_CMD_MAX_SIZE 1024
+#define DBG_BATCH_MAX   128
+#define DBG_SEARCH_MAX_HITS 255
+// As many ranges as fit in a decoded command
+#define DBG_READV_MAX   127
+// As many addresses as fit in a decoded command
+#define DBG_BREAKPOINTS_MAX 253
+// Instructions stepped in a range before reporting a stop anyway
+#define DBG_RANGE_STEP_MAX 100000
+// Nested calls of profiled functions timed at once
+#define DBG_PROFILE_DEPTH 64
+// BREAKPOINT_PROFILE breakpoints, their counters are kept apart from the table
+#define DBG_PROFILE_MAX 128
+// Bytecode of all breakpoint conditions and tracepoint actions
+#define DBG_POOL_SIZE   2048
 
 typedef enum
 {
@@ -52,35 +68,172 @@ typedef enum
     ERROR_NO_BREAKPOINT         = 5,
     ERROR_NO_MEMORY_AVAILABLE   = 6,
     ERROR_UNMAPPED_MEMORY       = 7,
+    ERROR_UNSUPPORTED           = 8,
 } error_code;
 
 typedef enum
 {
     BREAKPOINT_NORMAL           = 0,
     BREAKPOINT_TRACE            = 1,
+    BREAKPOINT_STEP             = 2,    // Temporary, planted by CMD_STEP
+    BREAKPOINT_COVERAGE         = 3,    // Removed once hit, see CMD_COVERAGE
+    BREAKPOINT_PROFILE          = 4,    // See CMD_PROFILE_START
 } breakpoint_type;
 
+/*
+** Slot of the breakpoint table. Kept to 32 bytes, 2048 of them fit in the
+** .breakpoints section.
+*/
 typedef struct
 {
-    breakpoint_type type;
-    void* address;
-    u32 original_instruction[2];
+    breakpoint_type type : 8;
     char enabled;
+    // Counters of a BREAKPOINT_PROFILE in status.profiles
+    u16 profile;
+    void* address;
+    u32 original_instruction;
+    // Relocated original instruction, executed to resume from the breakpoint
+    u32* trampoline;
+
+    // Condition bytecode in the status pool, see cmd_insert_breakpoint
+    u16 condition_offset;
+    u16 condition_size;
+    // Tracepoint actions in the status pool, see CMD_TRACE_ACTIONS
+    u16 actions_offset;
+    u16 actions_size;
+
+    // Hits with the condition true, and how many of the next ones to resume
+    // from silently, see CMD_IGNORE_COUNT
+    u32 hits;
+    u32 ignore_count;
 } breakpoint;
 
+/*
+** Tracepoint action, collecting either:
+** - the registers of mask "value" (bits 0-15 for r0-r15, bit 16 for cpsr)
+** - "size" bytes of memory at r"reg" + "value", or at "value" if reg is 0xff
+** - the memory recorded by the "size" bytes of agent expression that follow
+*/
+typedef enum
+{
+    TRACE_ACTION_REGISTERS      = 'R',
+    TRACE_ACTION_MEMORY         = 'M',
+    TRACE_ACTION_EXPRESSION     = 'X',
+} trace_action_type;
+
+typedef struct __packed
+{
+    trace_action_type type : 8;
+    u8 reg;
+    u16 size;
+    u32 value;
+    u8 code[0];
+} trace_action;
+
+/*
+** Call of a profiled function, which returns to the profiling stub instead of
+** "lr".
+*/
+typedef struct
+{
+    void* function;
+    u32 lr;
+    u32 start;
+} profile_call;
+
+/*
+** Calls and inclusive cycles of a profiled function, also the entry of the
+** CMD_PROFILE_DUMP reply.
+*/
+typedef struct
+{
+    u32 address;
+    u32 calls;
+    u64 cycles;
+} profile_entry;
+
+/*
+** Entry of the CMD_BREAKPOINT_COUNTERS reply
+*/
+typedef struct __packed
+{
+    u32 address;
+    breakpoint_type type : 8;
+    u8 reserved[3];
+    u32 hits;
+    u32 ignore_count;
+} breakpoint_counter;
+
+typedef struct
+{
+    u8* addr;
+    u32 size;
+    u32 written;
+} write_stream;
+
 typedef struct
 {
     char initialized;
 
-    breakpoint bp[DBG_NBR_POINTS];
+    // Open addressing hash table of breakpoints keyed by address, a NULL
+    // address marks a free slot. The number of slots is a power of two.
+    breakpoint* bp;
+    uint bp_slots;
+    uint bp_shift;
     uint bp_size;
 
+    // Trampolines are slots of RELOC_MAX_SIZE words in the trampoline arena.
+    // Freed ones are chained through their first word, the others are past
+    // "trampoline_next".
+    u32* trampoline_next;
+    u32* trampoline_free;
+
+    // Caches are synchronized once per command: the range of trampolines
+    // written and whether any code changed are kept until then.
+    u32* dirty_start;
+    u32* dirty_end;
+    char code_patched;
+
+    // Range of the coverage bitmap
+    u32 coverage_start;
+    u32 coverage_size;
+
+    u8 pool[DBG_POOL_SIZE];
+    uint pool_size;
+
+    // Tracepoints collect frames while set
+    char tracing;
+
+    // Profiled functions are timed while set. Their returns trap on the
+    // BKPT at "profile_return", and the calls in progress are stacked.
+    char profiling;
+    profile_entry profiles[DBG_PROFILE_MAX];
+    uint profile_count;
+    u32* profile_return;
+    profile_call profile_calls[DBG_PROFILE_DEPTH];
+    uint profile_depth;
+
     u32 continue_address;
+    char resume;
+
+    // Where CMD_STEP stops next, NULL if not stepping. The breakpoint there
+    // is planted by it unless one already was.
+    void* step_address;
+    char step_planted;
+    // Stepping goes on while pc is in [step_start, step_end)
+    u32 step_start;
+    u32 step_end;
+    uint step_count;
+
+    write_stream stream;
+
+    // Bytes decoded for the command being dispatched
+    uint cmd_size;
 } dbg_status;
 
 void dbg_init(void);
 
-void dbg_break_handler(event_type, context*);
+void dbg_event_handler(event_type, context*);
 
 /*
 ** Commands understood by the debugger
@@ -97,6 +250,29 @@ typedef enum
     CMD_REMOVE_BREAKPOINT = 6,
     CMD_BREAKPOINT_CONTINUE = 7,
     CMD_GET_REGISTERS   = 8,
+    CMD_WRITE_BEGIN     = 9,
+    CMD_WRITE_DATA      = 10,
+    CMD_BATCH           = 11,
+    CMD_READ_RLE        = 12,
+    CMD_EVENT           = 13,
+    CMD_SEARCH          = 14,
+    CMD_CHECKSUM        = 15,
+    CMD_READV           = 16,
+    CMD_SET_REGISTERS   = 17,
+    CMD_STEP            = 18,
+    CMD_MEMORY_MAP      = 19,
+    CMD_TRACE_ACTIONS   = 20,
+    CMD_TRACE_START     = 21,
+    CMD_TRACE_STOP      = 22,
+    CMD_TRACE_DUMP      = 23,
+    CMD_INSERT_BREAKPOINTS = 24,
+    CMD_REMOVE_BREAKPOINTS = 25,
+    CMD_COVERAGE        = 26,
+    CMD_PROFILE_START   = 27,
+    CMD_PROFILE_STOP    = 28,
+    CMD_PROFILE_DUMP    = 29,
+    CMD_IGNORE_COUNT    = 30,
+    CMD_BREAKPOINT_COUNTERS = 31,
 
     CMD_CALL            = 50,
     CMD_FASTBOOT_REBOOT = 51,
@@ -112,6 +288,7 @@ typedef struct __attribute__((packed, aligned(4)))
 {
     cmd_type type : 8;
     error_code error : 8;
+    u16 seq;
 
     union
     {
@@ -128,10 +305,35 @@ typedef struct __attribute__((packed, aligned(4)))
             u8 data[0];
         } write;
 
+        /*
+        ** Chunks of a stream are sent in order, each once the previous one is
+        ** acknowledged. Caches are synchronized after the last one.
+        */
+        struct __packed
+        {
+            void* addr;
+            u32 size;
+        } write_begin;
+
+        struct __packed
+        {
+            u32 offset;
+            u32 size;
+            u8 data[0];
+        } write_data;
+
+        /*
+        ** The target stops on the breakpoint if any of the conditions, GDB
+        ** agent expressions each prefixed by its u16 size, is true. There is
+        ** no condition if condition_size is 0.
+        */
         struct __packed
         {
             void* addr;
             breakpoint_type type : 8;
+            u8 reserved[3];
+            u32 condition_size;
+            u8 condition[0];
         } breakpoint;
 
         struct __packed
@@ -145,6 +347,117 @@ typedef struct __attribute__((packed, aligned(4)))
             context ctx[0];
         } registers;
 
+        /*
+        ** Each entry is a u32 size followed by a command of that size, padded
+        ** to 4 bytes.
+        */
+        struct __packed
+        {
+            u32 count;
+            u32 size;
+            u8 entries[0];
+        } batch;
+
+        /*
+        ** The pattern is followed by the mask when masked is set.
+        */
+        struct __packed
+        {
+            void* addr;
+            u32 size;
+            u16 pattern_size;
+            u8 masked;
+            u8 max_hits;
+            u8 data[0];
+        } search;
+
+        /*
+        ** One CRC for the whole range if block_size is 0, else one CRC per
+        ** block.
+        */
+        struct __packed
+        {
+            void* addr;
+            u32 size;
+            u32 block_size;
+        } checksum;
+
+        struct __packed
+        {
+            u32 count;
+            struct __packed
+            {
+                void* addr;
+                u32 size;
+            } ranges[0];
+        } readv;
+
+        /*
+        ** Bit i of mask set for ri, bit 16 for cpsr. Values follow in the same
+        ** order.
+        */
+        struct __packed
+        {
+            u32 mask;
+            u32 values[0];
+        } set_registers;
+
+        /*
+        ** Step until pc leaves [start, end), a single instruction if the range
+        ** is empty.
+        */
+        struct __packed
+        {
+            u32 start;
+            u32 end;
+        } step;
+
+        /*
+        ** Breakpoints of the same type inserted or removed at once, without
+        ** condition.
+        */
+        struct __packed
+        {
+            u32 count;
+            breakpoint_type type : 8;
+            u8 reserved[3];
+            void* addr[0];
+        } breakpoints;
+
+        /*
+        ** trace_action entries, each padded to 4 bytes.
+        */
+        struct __packed
+        {
+            void* addr;
+            u32 size;
+            u8 actions[0];
+        } trace_actions;
+
+        struct __packed
+        {
+            void* addr;
+            u32 size;
+        } coverage;
+
+        /*
+        ** The next "count" hits of the breakpoint at addr don't stop the
+        ** target.
+        */
+        struct __packed
+        {
+            void* addr;
+            u32 count;
+        } ignore_count;
+
+        /*
+        ** Hit counters are zeroed once replied if reset is set.
+        */
+        struct __packed
+        {
+            u32 reset;
+        } breakpoint_counters;
+
         struct __packed
         {
             u32 time;
@@ -152,12 +465,49 @@ typedef struct __attribute__((packed, aligned(4)))
     };
 } command;
 
+/*
+** Response structure
+**
+** Every reply starts with this header, so that the host knows exactly how many
+** bytes to wait for instead of reading until a timeout. The magic lets the host
+** skip anything HBOOT sends before it (command echo, prompt, ...).
+**
+** A response may be split in several frames sharing the same sequence number,
+** all of them but the last one have RESPONSE_MORE set.
+*/
+
+# define RESPONSE_MAGIC 0xdb9d
+# define RESPONSE_MORE  (1 << 0)
+
+typedef struct __packed
+{
+    u16 magic;
+    u16 seq;
+    cmd_type type : 8;
+    error_code error : 8;
+    u16 flags;
+    u32 size;
+} response;
+
+/*
+** Unsolicited response (sequence number 0, type CMD_EVENT) pushed to the host
+** as soon as the debugger takes control.
+*/
+
+typedef struct __packed
+{
+    u32 type;
+    u32 pc;
+    u32 cpsr;
+} stop_event;
+
 /*
 ** Functions
 */
 
-void cmd_dispatcher(command*, context*);
+void cmd_dispatcher(command*, uint size, context*);
 
+void cmd_reply(command*, error_code, u32);
 void cmd_success(command*);
 void cmd_error(command*, error_code);
 
@@ -165,11 +515,33 @@ void cmd_attach(command*, context*);
 void cmd_detach(command*, context*);
 
 void cmd_read(command*, context*);
+void cmd_read_rle(command*, context*);
+void cmd_search(command*, context*);
+void cmd_checksum(command*, context*);
+void cmd_readv(command*, context*);
+void cmd_memory_map(command*, context*);
+void cmd_trace_actions(command*, context*);
+void cmd_trace_start(command*, context*);
+void cmd_trace_stop(command*, context*);
+void cmd_trace_dump(command*, context*);
+void cmd_coverage(command*, context*);
+void cmd_profile_start(command*, context*);
+void cmd_profile_stop(command*, context*);
+void cmd_profile_dump(command*, context*);
+void cmd_ignore_count(command*, context*);
+void cmd_breakpoint_counters(command*, context*);
 void cmd_write(command*, context*);
+void cmd_write_begin(command*, context*);
+void cmd_write_data(command*, context*);
 void cmd_insert_breakpoint(command*, context*);
 void cmd_remove_breakpoint(command*, context*);
+void cmd_insert_breakpoints(command*, context*);
+void cmd_remove_breakpoints(command*, context*);
 void cmd_get_registers(command*, context*);
+void cmd_set_registers(command*, context*);
 void cmd_breakpoint_continue(command*, context*);
+void cmd_step(command*, context*);
+void cmd_batch(command*, context*);
 
 void cmd_call(command*, context*);
 void cmd_breakpoint(command*, context*);
@@ -53,13 +53,14 @@
 
 int hbootdbg(char* cmd, char** argv)
 {
-    char decoded_buf[1024];
+    char decoded_buf[DBG_CMD_MAX_SIZE];
+    uint decoded_len;
 
     if ((u32) cmd < 100)
-        base64_decode(argv[1], decoded_buf);
+        decoded_len = base64_decode(argv[1], decoded_buf);
     else
-        base64_decode(cmd, decoded_buf);
+        decoded_len = base64_decode(cmd, decoded_buf);
 
-    cmd_dispatcher((command*) decoded_buf, NULL);
+    cmd_dispatcher((command*) decoded_buf, decoded_len, NULL);
     return 0;
 }
@@ -120,6 +120,19 @@ void mmu_invalidate_icache_range(void* addr, size_t size)
   }
 }
 
+/*
+** Invalidates the whole instruction cache and the branch predictor, cheaper
+** than going over many scattered lines.
+*/
+void mmu_invalidate_icache(void)
+{
+    ASM(
+        "mcr p15, 0, %0, c7, c5, 0\n"
+        "mcr p15, 0, %0, c7, c5, 6\n"
+        :: "r" (0)
+    );
+}
+
 /*
 ** Invalidate a single line in both instruction and data caches.
 */
@@ -201,6 +214,42 @@ mmu_section_descriptor* mmu_get_translation_table(void)
     return page_table;
 }
 
+/*
+** Finds the first mapped region starting at or after a section index, and
+** returns the index following it. The region count is 0 if there is none left.
+** Page tables are not walked, a coarse or fine entry maps the whole section.
+*/
+uint mmu_next_region(uint section, mmu_region* region)
+{
+    mmu_section_descriptor* ttbr = mmu_get_translation_table();
+    mmu_section_descriptor first;
+
+    while (section < MMU_SECTIONS_NR
+           && ttbr[section].bits.type == MMU_PAGE_TYPE_UNMAPPED)
+        section++;
+
+    region->section = section;
+    region->count = 0;
+    region->reserved = 0;
+
+    if (section == MMU_SECTIONS_NR)
+        return section;
+
+    first = ttbr[section];
+    region->type = first.bits.type;
+    region->ap = first.bits.type == MMU_PAGE_TYPE_SECTION ? first.bits.ap : 0;
+
+    do {
+        region->count++;
+        section++;
+    } while (section < MMU_SECTIONS_NR
+             && ttbr[section].bits.type == first.bits.type
+             && (first.bits.type != MMU_PAGE_TYPE_SECTION
+                 || ttbr[section].bits.ap == first.bits.ap));
+
+    return section;
+}
+
 /*
 ** Checks if a memory area is readable.
 ** ARMv5 only, assumes APX is not implemented.
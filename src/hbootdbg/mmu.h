@@ -54,6 +54,7 @@
 
 # define MMU_PAGE_SECTION_SHIFT 20
 # define MMU_PAGE_SECTION_SIZE (1 << MMU_PAGE_SECTION_SHIFT)
+# define MMU_SECTIONS_NR (1 << (32 - MMU_PAGE_SECTION_SHIFT))
 
 # define MMU_PAGE_TYPE_UNMAPPED 0
 # define MMU_PAGE_TYPE_COARSE 1
@@ -111,6 +112,19 @@ typedef union
     } bits;
 } mmu_section_descriptor;
 
+/*
+** Run of consecutive first level entries of the same type, and with the same
+** access permissions for sections (ap is 0 for page tables).
+*/
+typedef struct __packed
+{
+    u16 section;
+    u16 count;
+    u8 type;
+    u8 ap;
+    u16 reserved;
+} mmu_region;
+
 /*
 ** General MMU operations
 */
@@ -120,6 +134,7 @@ void mmu_disable(void);
 
 cache_type_register mmu_get_cache_type_register(void);
 mmu_section_descriptor* mmu_get_translation_table(void);
+uint mmu_next_region(uint section, mmu_region* region);
 
 /*
 ** Data cache operations
@@ -136,6 +151,7 @@ void mmu_invalidate_dcache_range(void* addr, size_t size);
 uint mmu_get_icache_line_size(void);
 void mmu_invalidate_icache_line(void* addr);
 void mmu_invalidate_icache_range(void* addr, size_t size);
+void mmu_invalidate_icache(void);
 
 /*
 ** Both caches operations
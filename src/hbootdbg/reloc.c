@@ -35,56 +35,438 @@
 
 #include "reloc.h"
 
-#include "darm/darm.h"
+#define COND_AL                 0xe
+#define COND_UNCOND             0xf
 
-int darm_armv7_update(darm_t* d)
+#define ARM_B                   0x0a000000
+#define ARM_LDR_LITERAL         0xe51f0000  // ldr rX, [pc, #-0]
+#define ARM_LDR_U               (1 << 23)
+#define ARM_PUSH_ONE(n)         (0xe52d0000 | (n))  // str rX, [sp, #-n]!
+#define ARM_POP_ONE             0xe49d0004  // ldr rX, [sp], #4
+#define ARM_STR_SP_4            0xe58d0004  // str rX, [sp, #4]
+#define ARM_MOV                 0xe1a00000  // mov rX, rY
+#define ARM_BX                  0xe12fff10
+
+#define REG(instr, field)       (((instr) >> (field)) & 0xf)
+#define PC                      15
+#define SP                      13
+#define LR                      14
+
+// Register fields of an instruction, by their position
+#define FIELD_M                 0
+#define FIELD_S                 8
+#define FIELD_D                 12
+#define FIELD_N                 16
+#define NO_FIELD                -1
+
+// Most literals of a sequence: a conditional BL out of range of both its
+// target and the jump back loads lr, the target and the return address
+#define MAX_LITERALS            3
+
+/*
+** Register operands of an instruction: the fields it reads, the one it writes
+** if any (the second register of LDRD/STRD is the one after it).
+*/
+typedef struct
+{
+    int reads[4];
+    uint nbr_reads;
+    int dest;
+    int dual;
+    int writeback;
+} operands;
+
+/*
+** Sequence being built, literals are placed after the instructions.
+*/
+typedef struct
 {
-    d->w = 0;
+    u32* out;
+    u32 addr;
+    uint size;
+    uint nbr_literals;
+    uint literal_at[MAX_LITERALS];
+    u32 literals[MAX_LITERALS];
+} sequence;
 
-    d->w |= (d->cond << 28);
-    switch (d->instr)
+static
+void emit(sequence* seq, u32 instr)
+{
+    seq->out[seq->size++] = instr;
+}
+
+static
+void emit_load(sequence* seq, uint reg, u32 value)
+{
+    seq->literal_at[seq->nbr_literals] = seq->size;
+    seq->literals[seq->nbr_literals++] = value;
+    emit(seq, ARM_LDR_LITERAL | (reg << 12));
+}
+
+/*
+** B if the destination is in range, else a load to pc.
+*/
+static
+void emit_jump(sequence* seq, u32 to)
+{
+    s32 offset = to - (seq->addr + seq->size * 4 + 8);
+
+    if (offset >= -0x2000000 && offset < 0x2000000)
+        emit(seq, (COND_AL << 28) | ARM_B | ((offset >> 2) & 0xffffff));
+    else
+        emit_load(seq, PC, to);
+}
+
+static
+uint finish(sequence* seq)
+{
+    s32 offset;
+
+    for (uint i = 0; i < seq->nbr_literals; ++i)
     {
-    case I_B:
-        d->w |= (0b1010 << 24);
-        d->w |= (d->imm & 0xffffff);
-        break;
+        offset = (seq->size - seq->literal_at[i]) * 4 - 8;
+        seq->out[seq->literal_at[i]] |= offset < 0 ? (u32) -offset
+                                                   : (u32) offset | ARM_LDR_U;
+        emit(seq, seq->literals[i]);
+    }
 
-    case I_BL:
-        d->w |= (0b1011 << 24);
-        d->w |= (d->imm & 0xffffff);
-        break;
+    return seq->size;
+}
 
-    default:
-        return -1;
-    };
+static
+void add_read(operands* op, int field)
+{
+    op->reads[op->nbr_reads++] = field;
+}
+
+static
+int reads_reg(u32 instr, const operands* op, uint reg)
+{
+    for (uint i = 0; i < op->nbr_reads; ++i)
+        if (REG(instr, op->reads[i]) == reg)
+            return 1;
 
     return 0;
 }
 
-int relocate_instruction(u32* instr,
-                         u32 src_addr,
-                         u32 dst_addr)
+/*
+** Whether any register field of the instruction is pc, for the encodings where
+** it is unpredictable.
+*/
+static
+int uses_pc(u32 instr)
+{
+    return REG(instr, FIELD_M) == PC || REG(instr, FIELD_S) == PC
+        || REG(instr, FIELD_D) == PC || REG(instr, FIELD_N) == PC;
+}
+
+/*
+** Single register loads and stores, the "extra" ones (halfword, signed byte
+** and dual) included.
+*/
+static
+void decode_load_store(u32 instr, operands* op, int register_offset, int dual)
 {
-    darm_t d;
+    int load = (instr >> 20) & 1;
 
-    if (darm_armv7_disasm(&d, *instr) != 0)
-        return -1;
+    add_read(op, FIELD_N);
+    if (register_offset)
+        add_read(op, FIELD_M);
 
-    switch (d.instr)
+    if (dual)
+        load = !((instr >> 5) & 1);     // LDRD is op2 10, STRD 11
+
+    if (load)
+        op->dest = FIELD_D;
+    else
+        add_read(op, FIELD_D);
+
+    op->dual = dual;
+    op->writeback = !((instr >> 24) & 1) || ((instr >> 21) & 1);
+}
+
+/*
+** Decode the register operands of the instructions which may read pc as a
+** general purpose register. Returns 0 for the ones which are copied as is,
+** either because they can't read pc or because reading it is unpredictable,
+** and -1 for the ones which can't be relocated.
+*/
+static
+int decode(u32 instr, operands* op)
+{
+    uint op1 = (instr >> 25) & 7;
+    uint opcode = (instr >> 21) & 0xf;
+    int misc = ((instr >> 23) & 3) == 2 && !((instr >> 20) & 1);
+
+    op->nbr_reads = 0;
+    op->dest = NO_FIELD;
+    op->dual = 0;
+    op->writeback = 0;
+
+    switch (op1)
     {
-    case I_B:
-    case I_BL:
-        d.imm += (src_addr - dst_addr);
+    case 0:
+        // Multiplies and synchronization primitives
+        if ((instr & 0x90) == 0x90 && (instr & 0x60) == 0)
+            return uses_pc(instr) ? -1 : 0;
+
+        // Extra loads and stores
+        if ((instr & 0x90) == 0x90)
+        {
+            decode_load_store(instr, op, !((instr >> 22) & 1),
+                              !((instr >> 20) & 1) && ((instr >> 6) & 1));
+            return 1;
+        }
+
+        // BX, CLZ, MRS, saturating arithmetic...
+        if (misc && (instr & 0x0fffffc0) == 0x012fff00)
+            return REG(instr, FIELD_M) == PC ? -1 : 0;
+        if (misc)
+            return REG(instr, FIELD_M) == PC || REG(instr, FIELD_D) == PC
+                   ? -1 : 0;
+
+        if ((instr >> 4) & 1)
+        {
+            // Register shifted register, pc is unpredictable
+            if (uses_pc(instr))
+                return -1;
+            return 0;
+        }
+
+        add_read(op, FIELD_M);
         break;
 
+    case 1:
+        // MOVW, MOVT, MSR and hints
+        if (misc)
+            return 0;
+        break;
+
+    case 2:
+        decode_load_store(instr, op, 0, 0);
+        return 1;
+
+    case 3:
+        // Media instructions
+        if ((instr >> 4) & 1)
+            return uses_pc(instr) ? -1 : 0;
+        decode_load_store(instr, op, 1, 0);
+        return 1;
+
+    case 4:
+        // LDM and STM, pc as the base or stored is not supported
+        if (REG(instr, FIELD_N) == PC
+            || (!((instr >> 20) & 1) && ((instr >> 15) & 1)))
+            return -1;
+        return 0;
+
+    case 6:
+        // MCRR and MRRC
+        if (((instr >> 21) & 0xf) == 0x2)
+            return uses_pc(instr) ? -1 : 0;
+
+        // LDC, STC, and VLDR and VSTR in particular
+        add_read(op, FIELD_N);
+        op->writeback = (instr >> 21) & 1;
+        return 1;
+
     default:
+        return 0;
+    }
+
+    // Data processing, MOV and MVN have no first operand, comparisons no
+    // destination
+    if (opcode != 0xd && opcode != 0xf)
+        add_read(op, FIELD_N);
+    if ((opcode & 0xc) != 0x8)
+    {
+        op->dest = FIELD_D;
+
+        // Exception return
+        if (REG(instr, FIELD_D) == PC && ((instr >> 20) & 1))
+            return -1;
+    }
+
+    return 1;
+}
+
+/*
+** Replace pc by "reg" in the register fields the instruction reads, and in its
+** destination if "dest" is set.
+*/
+static
+u32 substitute(u32 instr, const operands* op, uint reg, int dest)
+{
+    for (uint i = 0; i < op->nbr_reads; ++i)
+        if (REG(instr, op->reads[i]) == PC)
+            instr = (instr & ~(0xf << op->reads[i])) | (reg << op->reads[i]);
+
+    if (dest && op->dest != NO_FIELD && REG(instr, op->dest) == PC)
+        instr = (instr & ~(0xf << op->dest)) | (reg << op->dest);
+
+    return instr;
+}
+
+/*
+** Body of the sequence of an instruction reading pc. Its value is loaded into
+** a register which replaces pc in the instruction: the destination register
+** when it is not an operand, else a register saved on the stack.
+*/
+static
+int relocate_pc_read(sequence* seq, u32 instr, const operands* op, u32 src)
+{
+    int has_dest = op->dest != NO_FIELD;
+    uint dest = has_dest ? REG(instr, op->dest) : 0;
+    uint scratch;
+
+    instr = (instr & 0x0fffffff) | (COND_AL << 28);
+
+    if (op->writeback && REG(instr, FIELD_N) == PC)
         return -1;
-    };
 
-    if (darm_armv7_update(&d) != 0)
+    if (has_dest && dest != PC && !op->dual && !op->writeback
+        && !reads_reg(instr, op, dest))
+    {
+        emit_load(seq, dest, src + 8);
+        emit(seq, substitute(instr, op, dest, 0));
+        return 0;
+    }
+
+    // The stack is used, so sp can't be an operand
+    if (reads_reg(instr, op, SP) || (has_dest && dest == SP))
         return -1;
 
-    *instr = d.w;
+    for (scratch = 0; scratch < SP; ++scratch)
+        if (!reads_reg(instr, op, scratch)
+            && !(has_dest && (scratch == dest
+                              || (op->dual && scratch == dest + 1))))
+            break;
+
+    if (has_dest && dest == PC)
+    {
+        // The result is stored above the saved register, then popped to pc
+        emit(seq, ARM_PUSH_ONE(8) | (scratch << 12));
+        emit_load(seq, scratch, src + 8);
+        emit(seq, substitute(instr, op, scratch, 1));
+        emit(seq, ARM_STR_SP_4 | (scratch << 12));
+        emit(seq, ARM_POP_ONE | (scratch << 12));
+        emit(seq, ARM_POP_ONE | (PC << 12));
+    }
+    else
+    {
+        emit(seq, ARM_PUSH_ONE(4) | (scratch << 12));
+        emit_load(seq, scratch, src + 8);
+        emit(seq, substitute(instr, op, scratch, 0));
+        emit(seq, ARM_POP_ONE | (scratch << 12));
+    }
 
     return 0;
 }
+
+/*
+** BLX <reg> sets lr to the instruction following it in the original code, not
+** in the sequence, which may be gone by the time the call returns.
+*/
+static
+void relocate_blx(sequence* seq, u32 instr, u32 src)
+{
+    uint rm = REG(instr, FIELD_M);
+
+    if (rm != LR)
+    {
+        emit_load(seq, LR, src + 4);
+        emit(seq, ARM_BX | rm);
+        return;
+    }
+
+    // Call through the stack, since lr is both the target and overwritten
+    emit(seq, ARM_PUSH_ONE(8) | (0 << 12));
+    emit(seq, ARM_MOV | (0 << 12) | LR);
+    emit(seq, ARM_STR_SP_4 | (0 << 12));
+    emit_load(seq, LR, src + 4);
+    emit(seq, ARM_POP_ONE | (0 << 12));
+    emit(seq, ARM_POP_ONE | (PC << 12));
+}
+
+uint relocate_instruction(u32 instr, u32 src, u32 dst, u32* out)
+{
+    sequence seq = { out, dst, 0, 0, { 0 }, { 0 } };
+    uint cond = instr >> 28;
+    operands op;
+    uint back;
+    s32 offset;
+
+    // Instructions executed unconditionally, only BLX <label> is relative
+    if (cond == COND_UNCOND)
+    {
+        if ((instr & 0x0e000000) == 0x0a000000)
+        {
+            offset = (s32) (instr << 8) >> 6;
+            emit_load(&seq, LR, src + 4);
+            emit_load(&seq, PC,
+                      (src + 8 + offset + ((instr >> 23) & 2)) | 1);
+            return finish(&seq);
+        }
+
+        emit(&seq, instr);
+        emit_jump(&seq, src + 4);
+        return finish(&seq);
+    }
+
+    // Conditional sequences start by skipping to the jump back if the
+    // condition fails, patched once its position is known
+    if (cond != COND_AL)
+        emit(&seq, 0);
+
+    if ((instr & 0x0e000000) == 0x0a000000)
+    {
+        // B and BL, nothing reaches the jump back when they always branch
+        offset = (s32) (instr << 8) >> 6;
+        if ((instr >> 24) & 1)
+            emit_load(&seq, LR, src + 4);
+        emit_jump(&seq, src + 8 + offset);
+        if (cond == COND_AL)
+            return finish(&seq);
+    }
+    else if ((instr & 0x0ffffff0) == 0x012fff30)
+    {
+        if (REG(instr, FIELD_M) == PC)
+            return 0;
+        relocate_blx(&seq, instr, src);
+        if (cond == COND_AL)
+            return finish(&seq);
+    }
+    else
+    {
+        switch (decode(instr, &op))
+        {
+        case -1:
+            return 0;
+
+        case 1:
+            if (reads_reg(instr, &op, PC))
+            {
+                if (relocate_pc_read(&seq, instr, &op, src) != 0)
+                    return 0;
+                break;
+            }
+            // Fall through
+
+        default:
+            // Copied as is, with its condition
+            if (cond != COND_AL)
+                seq.size = 0;
+            emit(&seq, instr);
+            emit_jump(&seq, src + 4);
+            return finish(&seq);
+        }
+    }
+
+    back = seq.size;
+    emit_jump(&seq, src + 4);
+
+    if (cond != COND_AL)
+        out[0] = ((cond ^ 1) << 28) | ARM_B | ((back * 4 - 8) >> 2);
+
+    return finish(&seq);
+}
@@ -36,10 +36,20 @@
 #ifndef RELOCATOR_H_
 # define RELOCATOR_H_
 
-# include "darm/darm.h"
+# include "cpu.h"
 
-u32 relocate_arm_instruction(u32 instruction,
-                             u32 original_address,
-                             u32 relocated_address);
+/*
+** Longest sequence an instruction is relocated to, in words
+*/
+# define RELOC_MAX_SIZE         10
+
+/*
+** Write to "out" a sequence equivalent to the ARM instruction "instr" located
+** at "src", to be executed at "dst", after which execution goes on at src + 4
+** unless the instruction branched. Instructions reading pc are rewritten to
+** read its value from another register. Returns the size of the sequence in
+** words, or 0 if the instruction can't be relocated.
+*/
+uint relocate_instruction(u32 instr, u32 src, u32 dst, u32* out);
 
 #endif /* RELOCATOR_H_ */
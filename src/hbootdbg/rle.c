@@ -0,0 +1,101 @@
+/*
+** This file is part of hbootdbg.
+** Copyright (C) 2013 Cedric Halbronn <cedric.halbronn@sogeti.com>
+** Copyright (C) 2013 Nicolas Hureau <nicolas.hureau@sogeti.com>
+** All rights reserved.
+**
+** Code greatly inspired by qcombbdbg.
+** Copyright (C) 2012 Guillaume Delugré <guillaume@security-labs.org>
+**
+** Redistribution and use in source and binary forms, with or without modification,
+** are permitted provided that the following conditions are met:
+**
+** * Redistributions of source code must retain the above copyright notice, this
+**   list of conditions and the following disclaimer.
+**
+** * Redistributions in binary form must reproduce the above copyright notice, this
+**   list of conditions and the following disclaimer in the documentation and/or
+**   other materials provided with the distribution.
+**
+** * Neither the name of the {organization} nor the names of its
+**   contributors may be used to endorse or promote products derived from
+**   this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+** WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+** ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+** (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+** LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+** ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+** SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "rle.h"
+
+#include "hbootlib.h"
+
+static
+uint rle_literal(const u8* in, uint size, u8* out)
+{
+    uint len;
+    uint written = 0;
+
+    while (size > 0)
+    {
+        len = size < RLE_MAX_LITERAL ? size : RLE_MAX_LITERAL;
+        out[written++] = len - 1;
+        memcpy(out + written, in, len);
+        written += len;
+        in += len;
+        size -= len;
+    }
+
+    return written;
+}
+
+static
+int rle_word_equal(const u8* a, const u8* b)
+{
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && a[3] == b[3];
+}
+
+/*
+** Compress "size" bytes from "in" to "out", returns the compressed size.
+** "out" must be able to hold RLE_MAX_SIZE(size) bytes.
+*/
+uint rle_compress(const u8* in, uint size, u8* out)
+{
+    uint i = 0;
+    uint literal = 0;
+    uint written = 0;
+    uint run;
+
+    while (i + 8 <= size)
+    {
+        run = 1;
+        while (run < RLE_MAX_RUN && i + (run + 1) * 4 <= size
+                && rle_word_equal(in + i, in + i + run * 4))
+            run++;
+
+        if (run < 2)
+        {
+            i++;
+            continue;
+        }
+
+        written += rle_literal(in + literal, i - literal, out + written);
+        out[written++] = 0x80 | (run - 2);
+        memcpy(out + written, in + i, 4);
+        written += 4;
+
+        i += run * 4;
+        literal = i;
+    }
+
+    written += rle_literal(in + literal, size - literal, out + written);
+
+    return written;
+}
@@ -0,0 +1,119 @@
+/*
+** This file is part of hbootdbg.
+** Copyright (C) 2013 Cedric Halbronn <cedric.halbronn@sogeti.com>
+** Copyright (C) 2013 Nicolas Hureau <nicolas.hureau@sogeti.com>
+** All rights reserved.
+**
+** Code greatly inspired by qcombbdbg.
+** Copyright (C) 2012 Guillaume Delugré <guillaume@security-labs.org>
+**
+** Redistribution and use in source and binary forms, with or without modification,
+** are permitted provided that the following conditions are met:
+**
+** * Redistributions of source code must retain the above copyright notice, this
+**   list of conditions and the following disclaimer.
+**
+** * Redistributions in binary form must reproduce the above copyright notice, this
+**   list of conditions and the following disclaimer in the documentation and/or
+**   other materials provided with the distribution.
+**
+** * Neither the name of the {organization} nor the names of its
+**   contributors may be used to endorse or promote products derived from
+**   this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+** WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+** ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+** (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+** LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+** ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+** SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "search.h"
+
+/*
+** Build the skip table. "mask" may be NULL, in which case every bit of the
+** pattern is significant.
+*/
+void search_init(search_pattern* p, const u8* pattern, const u8* mask, uint size)
+{
+    u8 m;
+
+    p->pattern = pattern;
+    p->mask = mask;
+    p->size = size;
+
+    for (uint c = 0; c < 256; ++c)
+        p->shift[c] = size;
+
+    // The last byte is not taken into account, as in Horspool's algorithm
+    for (uint j = 0; j + 1 < size; ++j)
+    {
+        m = mask == NULL ? 0xff : mask[j];
+
+        if (m == 0xff)
+            p->shift[pattern[j]] = size - 1 - j;
+        else
+        {
+            for (uint c = 0; c < 256; ++c)
+            {
+                if ((c & m) == (pattern[j] & m))
+                    p->shift[c] = size - 1 - j;
+            }
+        }
+    }
+}
+
+static
+int search_match(const search_pattern* p, const u8* addr)
+{
+    uint j = p->size;
+
+    if (p->mask == NULL)
+    {
+        while (j-- > 0)
+        {
+            if (addr[j] != p->pattern[j])
+                return 0;
+        }
+    }
+    else
+    {
+        while (j-- > 0)
+        {
+            if ((addr[j] & p->mask[j]) != (p->pattern[j] & p->mask[j]))
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+** Returns the address of the first match in [start, end), or end if there is
+** none.
+*/
+const u8* search_next(const search_pattern* p, const u8* start, const u8* end)
+{
+    const u8* addr = start;
+    const u8* last;
+
+    if ((uint) (end - start) < p->size)
+        return end;
+
+    last = end - p->size;
+
+    while (addr <= last && addr >= start)
+    {
+        if (search_match(p, addr))
+            return addr;
+
+        addr += p->shift[addr[p->size - 1]];
+    }
+
+    return end;
+}
@@ -0,0 +1,243 @@
+/*
+** This file is part of hbootdbg.
+** Copyright (C) 2013 Cedric Halbronn <cedric.halbronn@sogeti.com>
+** Copyright (C) 2013 Nicolas Hureau <nicolas.hureau@sogeti.com>
+** All rights reserved.
+**
+** Code greatly inspired by qcombbdbg.
+** Copyright (C) 2012 Guillaume Delugré <guillaume@security-labs.org>
+**
+** Redistribution and use in source and binary forms, with or without modification,
+** are permitted provided that the following conditions are met:
+**
+** * Redistributions of source code must retain the above copyright notice, this
+**   list of conditions and the following disclaimer.
+**
+** * Redistributions in binary form must reproduce the above copyright notice, this
+**   list of conditions and the following disclaimer in the documentation and/or
+**   other materials provided with the distribution.
+**
+** * Neither the name of the {organization} nor the names of its
+**   contributors may be used to endorse or promote products derived from
+**   this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+** WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+** ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+** (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+** LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+** ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+** SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "step.h"
+#include "mmu.h"
+
+#include "darm/darm.h"
+
+#define ROR(value, n)  (((value) >> (n)) | ((value) << ((32 - (n)) & 31)))
+
+static
+int condition_passed(u32 cond, u32 cpsr)
+{
+    u32 n = (cpsr >> 31) & 1;
+    u32 z = (cpsr >> 30) & 1;
+    u32 c = (cpsr >> 29) & 1;
+    u32 v = (cpsr >> 28) & 1;
+
+    switch (cond)
+    {
+    case 0x0: return z;
+    case 0x1: return !z;
+    case 0x2: return c;
+    case 0x3: return !c;
+    case 0x4: return n;
+    case 0x5: return !n;
+    case 0x6: return v;
+    case 0x7: return !v;
+    case 0x8: return c && !z;
+    case 0x9: return !c || z;
+    case 0xa: return n == v;
+    case 0xb: return n != v;
+    case 0xc: return !z && n == v;
+    case 0xd: return z || n != v;
+    default:  return 1;
+    }
+}
+
+/*
+** Registers read as operands, pc reads as the address of the instruction plus
+** 8.
+*/
+static
+u32 get_reg(const context* ctx, uint reg, u32 pc)
+{
+    return reg == 15 ? pc + 8 : ctx->r[reg];
+}
+
+static
+u32 shift(u32 value, uint type, uint amount, int immediate, u32 cpsr)
+{
+    // Immediate shifts encode LSR #32 and ASR #32 as 0, and RRX as ROR #0
+    if (immediate && amount == 0)
+    {
+        if (type == 1 || type == 2)
+            amount = 32;
+        else if (type == 3)
+            return (value >> 1) | (((cpsr >> 29) & 1) << 31);
+    }
+
+    if (amount == 0)
+        return value;
+
+    switch (type)
+    {
+    case 0:  return amount >= 32 ? 0 : value << amount;
+    case 1:  return amount >= 32 ? 0 : value >> amount;
+    case 2:  return amount >= 32 ? (u32) ((int) value >> 31)
+                                 : (u32) ((int) value >> amount);
+    default: return ROR(value, amount & 31);
+    }
+}
+
+/*
+** Result of a data-processing instruction, the operands being decoded from the
+** instruction itself which has the same layout for all of them.
+*/
+static
+u32 data_processing(const context* ctx, u32 instr, u32 pc)
+{
+    u32 a = get_reg(ctx, (instr >> 16) & 0xf, pc);
+    u32 b;
+    u32 carry = (ctx->cpsr >> 29) & 1;
+
+    if (instr & (1 << 25))
+        b = ROR(instr & 0xff, ((instr >> 8) & 0xf) * 2);
+    else if (instr & (1 << 4))
+        b = shift(get_reg(ctx, instr & 0xf, pc), (instr >> 5) & 3,
+                  get_reg(ctx, (instr >> 8) & 0xf, pc) & 0xff, 0, ctx->cpsr);
+    else
+        b = shift(get_reg(ctx, instr & 0xf, pc), (instr >> 5) & 3,
+                  (instr >> 7) & 0x1f, 1, ctx->cpsr);
+
+    switch ((instr >> 21) & 0xf)
+    {
+    case 0x0: return a & b;
+    case 0x1: return a ^ b;
+    case 0x2: return a - b;
+    case 0x3: return b - a;
+    case 0x4: return a + b;
+    case 0x5: return a + b + carry;
+    case 0x6: return a - b - !carry;
+    case 0x7: return b - a - !carry;
+    case 0xc: return a | b;
+    case 0xd: return b;
+    case 0xe: return a & ~b;
+    case 0xf: return ~b;
+    default:  return pc + 4;        // Comparisons don't write pc
+    }
+}
+
+/*
+** Load pc from "addr", unless it can't be read.
+*/
+static
+int load_pc(u32 addr, u32* next)
+{
+    if (!mmu_probe_read((void*) addr, sizeof (u32)))
+        return -1;
+
+    *next = *(u32*) addr;
+    return 0;
+}
+
+int step_next_pc(const context* ctx, u32 instr, u32 pc, u32* next)
+{
+    darm_t d;
+    u32 addr;
+    u32 offset;
+    uint nbr_regs;
+
+    *next = pc + 4;
+
+    if (darm_armv7_disasm(&d, instr) != 0)
+        return 0;
+
+    if ((instr >> 28) != 0xf && !condition_passed(instr >> 28, ctx->cpsr))
+        return 0;
+
+    switch (d.instr_type)
+    {
+    case T_ARM_BRNCHSC:
+        if (d.instr == I_B || d.instr == I_BL)
+            *next = pc + 8 + d.imm;
+        break;
+
+    case T_ARM_UNCOND:
+        // BLX <label> always switches to Thumb
+        if (d.instr == I_BLX)
+            *next = (pc + 8 + d.imm) | 1;
+        break;
+
+    case T_ARM_BRNCHMISC:
+        if (d.instr == I_BX || d.instr == I_BLX)
+            *next = get_reg(ctx, d.Rm, pc);
+        break;
+
+    case T_ARM_ARITH_SHIFT:
+    case T_ARM_ARITH_IMM:
+    case T_ARM_DST_SRC:
+    case T_ARM_MOV_IMM:
+        if (((instr >> 12) & 0xf) == 15 &&
+            d.instr != I_MOVW && d.instr != I_MOVT)
+            *next = data_processing(ctx, instr, pc);
+        break;
+
+    case T_ARM_STACK0:
+        // LDR pc, including POP {pc}
+        if ((instr & (1 << 20)) && !(instr & (1 << 22)) &&
+            ((instr >> 12) & 0xf) == 15)
+        {
+            addr = get_reg(ctx, (instr >> 16) & 0xf, pc);
+            if (instr & (1 << 25))
+                offset = shift(get_reg(ctx, instr & 0xf, pc), (instr >> 5) & 3,
+                               (instr >> 7) & 0x1f, 1, ctx->cpsr);
+            else
+                offset = instr & 0xfff;
+
+            if (instr & (1 << 24))
+                addr = instr & (1 << 23) ? addr + offset : addr - offset;
+
+            return load_pc(addr, next);
+        }
+        break;
+
+    case T_ARM_LDSTREGS:
+        // LDM with pc in the list, including POP, pc being the last register
+        // loaded
+        if ((instr & (1 << 20)) && (instr & (1 << 15)))
+        {
+            addr = get_reg(ctx, (instr >> 16) & 0xf, pc);
+            nbr_regs = __builtin_popcount(instr & 0xffff);
+
+            // DA loads pc from the base address itself
+            switch ((instr >> 23) & 3)
+            {
+            case 1: addr += 4 * (nbr_regs - 1); break;      // IA
+            case 2: addr -= 4; break;                       // DB
+            case 3: addr += 4 * nbr_regs; break;            // IB
+            }
+
+            return load_pc(addr, next);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+** This file is part of hbootdbg.
+** Copyright (C) 2013 Cedric Halbronn <cedric.halbronn@sogeti.com>
+** Copyright (C) 2013 Nicolas Hureau <nicolas.hureau@sogeti.com>
+** All rights reserved.
+**
+** Code greatly inspired by qcombbdbg.
+** Copyright (C) 2012 Guillaume Delugré <guillaume@security-labs.org>
+**
+** Redistribution and use in source and binary forms, with or without modification,
+** are permitted provided that the following conditions are met:
+**
+** * Redistributions of source code must retain the above copyright notice, this
+**   list of conditions and the following disclaimer.
+**
+** * Redistributions in binary form must reproduce the above copyright notice, this
+**   list of conditions and the following disclaimer in the documentation and/or
+**   other materials provided with the distribution.
+**
+** * Neither the name of the {organization} nor the names of its
+**   contributors may be used to endorse or promote products derived from
+**   this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+** WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+** ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+** (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+** LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+** ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+** SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "trace.h"
+
+#include "hbootlib.h"
+
+#define ALIGN4(n)   (((n) + 3) & ~3)
+
+static struct
+{
+    u8 buffer[TRACE_BUFFER_SIZE];
+    // Frames are in [start, end), or [start, wrap) then [0, end) once the
+    // buffer wrapped
+    uint start;
+    uint end;
+    uint wrap;
+    uint frames;
+
+    // Frame being built
+    u8 frame[TRACE_FRAME_MAX];
+    uint frame_size;
+} trace;
+
+void trace_clear(void)
+{
+    trace.start = 0;
+    trace.end = 0;
+    trace.wrap = 0;
+    trace.frames = 0;
+}
+
+void trace_begin(u32 pc)
+{
+    trace_frame* frame = (trace_frame*) trace.frame;
+
+    frame->pc = pc;
+    trace.frame_size = sizeof (trace_frame);
+}
+
+int trace_collect(u8 type, u32 address, const void* data, uint size)
+{
+    trace_block* block = (trace_block*) (trace.frame + trace.frame_size);
+
+    // The frame may have less room left than a block header
+    if (trace.frame_size + sizeof (trace_block) > TRACE_FRAME_MAX
+        || size > TRACE_FRAME_MAX - trace.frame_size - sizeof (trace_block))
+        return 0;
+
+    block->type = type;
+    block->reserved = 0;
+    block->size = size;
+    block->address = address;
+    memcpy(block->data, data, size);
+    trace.frame_size += ALIGN4(sizeof (trace_block) + size);
+
+    return 1;
+}
+
+/*
+** Copy the frame at the end of the ring, dropping the oldest frames until it
+** fits.
+*/
+void trace_end(void)
+{
+    uint size = trace.frame_size;
+
+    ((trace_frame*) trace.frame)->size = size;
+
+    if (trace.frames == 0)
+        trace_clear();
+
+    while (1)
+    {
+        if (trace.wrap == 0)
+        {
+            if (trace.end + size <= TRACE_BUFFER_SIZE)
+                break;
+
+            trace.wrap = trace.end;
+            trace.end = 0;
+        }
+
+        if (trace.end + size <= trace.start)
+            break;
+
+        trace.start += ((trace_frame*) (trace.buffer + trace.start))->size;
+        trace.frames--;
+        if (trace.start == trace.wrap)
+        {
+            trace.start = 0;
+            trace.wrap = 0;
+        }
+    }
+
+    memcpy(trace.buffer + trace.end, trace.frame, size);
+    trace.end += size;
+    trace.frames++;
+}
+
+uint trace_get(const u8* parts[2], uint sizes[2])
+{
+    if (trace.frames == 0)
+        return 0;
+
+    parts[0] = trace.buffer + trace.start;
+    if (trace.wrap == 0)
+    {
+        sizes[0] = trace.end - trace.start;
+        return 1;
+    }
+
+    sizes[0] = trace.wrap - trace.start;
+    parts[1] = trace.buffer;
+    sizes[1] = trace.end;
+    return 2;
+}
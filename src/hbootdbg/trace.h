@@ -0,0 +1,85 @@
+/*
+** This file is part of hbootdbg.
+** Copyright (C) 2013 Cedric Halbronn <cedric.halbronn@sogeti.com>
+** Copyright (C) 2013 Nicolas Hureau <nicolas.hureau@sogeti.com>
+** All rights reserved.
+**
+** Code greatly inspired by qcombbdbg.
+** Copyright (C) 2012 Guillaume Delugré <guillaume@security-labs.org>
+**
+** Redistribution and use in source and binary forms, with or without modification,
+** are permitted provided that the following conditions are met:
+**
+** * Redistributions of source code must retain the above copyright notice, this
+**   list of conditions and the following disclaimer.
+**
+** * Redistributions in binary form must reproduce the above copyright notice, this
+**   list of conditions and the following disclaimer in the documentation and/or
+**   other materials provided with the distribution.
+**
+** * Neither the name of the {organization} nor the names of its
+**   contributors may be used to endorse or promote products derived from
+**   this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+** ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+** WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+** ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+** (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+** LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+** ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+** SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __TRACE_H__
+# define __TRACE_H__
+
+/*
+** Trace frames collected by tracepoints, kept in a ring buffer until the host
+** drains it. The oldest frames are dropped to make room for new ones.
+**
+** A frame is a trace_frame header followed by blocks, each a trace_block
+** header followed by its data. Frames and blocks are padded to 4 bytes.
+*/
+
+# define TRACE_BUFFER_SIZE      8192
+# define TRACE_FRAME_MAX        1024
+
+# define TRACE_BLOCK_REGISTERS  'R'     // address is the register mask
+# define TRACE_BLOCK_MEMORY     'M'
+
+typedef struct __packed
+{
+    u32 size;
+    u32 pc;
+    u8 data[0];
+} trace_frame;
+
+typedef struct __packed
+{
+    u8 type;
+    u8 reserved;
+    u16 size;
+    u32 address;
+    u8 data[0];
+} trace_block;
+
+void trace_clear(void);
+
+/*
+** A frame is built with trace_begin, then trace_collect for each block (which
+** returns 0 if the frame is full), and stored by trace_end.
+*/
+void trace_begin(u32 pc);
+int trace_collect(u8 type, u32 address, const void* data, uint size);
+void trace_end(void);
+
+/*
+** Frames from the oldest, in at most two parts since the buffer may wrap.
+** Returns the number of parts.
+*/
+uint trace_get(const u8* parts[2], uint sizes[2]);
+
+#endif // __TRACE_H__